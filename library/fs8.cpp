@@ -2,26 +2,50 @@
 #define _FILE_OFFSET_BITS 64
 #include <zstd.h>
 #include <zstd_errors.h>
+#include <zdict.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unordered_map>
 #include <unordered_set>
+#include <map>
+#include <list>
 #include <cctype>
 #include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <atomic>
 #include <algorithm>
 #include <codecvt>
 #include <thread>
 #include <filesystem>
 #include <cstring>
+#include <string_view>
+#include <cerrno>
 #include "fs8.h"
 
 
 #define FS_MAX_FILENAMES_BINARY_SIZE (64 << 20) // max file table = 16 MB (~320000 files)
-#define FS_MAX_FILE_SIZE (1 << 30)              // max file size 1 GB
-#define FS_KEEP_IN_MEMORY_THRESHOLD (64 << 10)  // small files (< 64 KB) will be cached in memory
+#define FS_MAX_FILE_SIZE (1 << 30)              // max size of a file read as a whole (getFileBytes to vector, getFileView) 1 GB
+#define FS_STREAM_THRESHOLD (64 << 20)          // larger files are read with Fs8FileReader
+#define FS_CACHE_ENTRY_OVERHEAD 96              // bytes charged to the cache budget for every entry
+#define FS_BATCH_MAX_READ (8 << 20)             // getFilesBytes: max size of one merged read
+#define FS_BATCH_MAX_GAP (64 << 10)             // getFilesBytes: files closer than this are read together
+#define FS_PREFETCH_THREADS 2                   // background threads of Fs8FileSystem::prefetch()
+#define FS_DICT_MIN_SAMPLES 16                  // fewer small files of one type are trained together with other types
+#define FS_DICT_MAX_COUNT 8                     // dictionaries in one archive
+#define FS_DICT_SAMPLES_PER_BYTE 100            // training samples per byte of the dictionary (zstd recommendation)
+#define FS_DICT_MAX_SAMPLES_SIZE (256 << 20)    // training samples of one dictionary
+#define FS_SIGN_CHUNK_SIZE (4 << 20)            // signature type 2: bytes hashed by one thread at a time
 #define FS_MAX_PARTITION 100
 #define FS_UNLOCK_FILE_AFTER_MS 500             // call fclose after 500 msec after last access
+#define FS_PACK_MAX_JOBS_IN_FLIGHT 64           // packer: max files read/compressed ahead of the writer
+#define FS_PACK_MAX_BYTES_IN_FLIGHT (256 << 20) // packer: max memory held by files ahead of the writer
+#define FS_PACK_REUSED_BUFFER_SIZE (4 << 20)    // packer: larger files are compressed by streaming, smaller ones through reused buffers
+#define FS_PACK_WRITE_BUFFER (1 << 20)          // packer: small blobs are collected into writes of this size
+#define FS_PACK_PREALLOCATE_STEP (64 << 20)     // packer: disk space is reserved ahead of the writer in steps of this size
+#define FS_FORMAT_VERSION 3                     // version 3: file table is Fs8Index, see serialize_fs_index()
+#define FS_ENTRY_FLAGS_SHIFT 56                 // version 2: the top byte of offsetInFile holds the entry flags
+#define FS_ENTRY_OFFSET_MASK ((int64_t(1) << FS_ENTRY_FLAGS_SHIFT) - 1)
 
 using namespace std;
 
@@ -43,6 +67,7 @@ string wstring_to_string(const wstring & wideString)
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <io.h>
 string get_absolute_file_name(const char * file_name_utf8)
 {
   if (!file_name_utf8)
@@ -56,7 +81,9 @@ string get_absolute_file_name(const char * file_name_utf8)
 
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 string get_absolute_file_name(const char * file_name_utf8)
 {
@@ -101,11 +128,81 @@ string get_absolute_file_name(const char * file_name_utf8)
     DeleteFileW(wName.c_str());
   }
 
-  void FS_RENAME(const char * file_from_utf8, const char * file_dest_utf8)
+  // replaces 'file_dest_utf8' if it exists
+  bool FS_RENAME(const char * file_from_utf8, const char * file_dest_utf8)
   {
     wstring wNameFrom = string_to_wstring(file_from_utf8);
     wstring wNameTo = string_to_wstring(file_dest_utf8);
-    MoveFileW(wNameFrom.c_str(), wNameTo.c_str());
+    return MoveFileExW(wNameFrom.c_str(), wNameTo.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+  }
+
+  // read-only view of the whole file, returns nullptr on failure
+  static const char * FS_MMAP(FILE * f, int64_t & size)
+  {
+    size = 0;
+    HANDLE fileHandle = (HANDLE)_get_osfhandle(_fileno(f));
+    LARGE_INTEGER fileSize;
+    if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart <= 0)
+      return nullptr;
+    HANDLE mapping = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+      return nullptr;
+    const char * ptr = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); // the view keeps the mapping object alive
+    if (!ptr)
+      return nullptr;
+    size = fileSize.QuadPart;
+    return ptr;
+  }
+
+  static void FS_MUNMAP(const char * ptr, int64_t size)
+  {
+    if (ptr)
+      UnmapViewOfFile(ptr);
+  }
+
+  static bool FS_FTRUNCATE(FILE * f, int64_t size)
+  {
+    fflush(f);
+    return _chsize_s(_fileno(f), size) == 0;
+  }
+
+  // flushes 'f' and waits until its data is on disk
+  static bool FS_FSYNC(FILE * f)
+  {
+    return fflush(f) == 0 && FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(f))) != 0;
+  }
+
+  // reserves disk space and extends the file to 'size' bytes
+  static bool FS_PREALLOCATE(FILE * f, int64_t size)
+  {
+    fflush(f);
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = size;
+    if (!SetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(f)), FileAllocationInfo, &info, sizeof(info)))
+      return false;
+    return _chsize_s(_fileno(f), size) == 0;
+  }
+
+  // positional read, does not use or move the FILE cursor, safe to call from several threads
+  static bool FS_PREAD(FILE * f, void * buffer, size_t size, int64_t offset)
+  {
+    HANDLE fileHandle = (HANDLE)_get_osfhandle(_fileno(f));
+    char * dst = (char *)buffer;
+    while (size > 0)
+    {
+      OVERLAPPED overlapped = { 0 };
+      overlapped.Offset = DWORD(uint64_t(offset));
+      overlapped.OffsetHigh = DWORD(uint64_t(offset) >> 32);
+      DWORD chunk = DWORD(min(size, size_t(1 << 30)));
+      DWORD bytesRead = 0;
+      if (!ReadFile(fileHandle, dst, chunk, &bytesRead, &overlapped) || bytesRead == 0)
+        return false;
+      dst += bytesRead;
+      size -= bytesRead;
+      offset += bytesRead;
+    }
+    return true;
   }
 
 #elif defined(__APPLE__)
@@ -135,9 +232,75 @@ string get_absolute_file_name(const char * file_name_utf8)
     unlink(file_name_utf8);
   }
 
-  void FS_RENAME(const char * file_from_utf8, const char * file_dest_utf8)
+  // atomically replaces 'file_dest_utf8' if it exists
+  bool FS_RENAME(const char * file_from_utf8, const char * file_dest_utf8)
+  {
+    return rename(file_from_utf8, file_dest_utf8) == 0;
+  }
+
+  static const char * FS_MMAP(FILE * f, int64_t & size)
+  {
+    size = 0;
+    struct stat buf;
+    if (fstat(fileno(f), &buf) != 0 || buf.st_size <= 0)
+      return nullptr;
+    void * ptr = mmap(nullptr, size_t(buf.st_size), PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (ptr == MAP_FAILED)
+      return nullptr;
+    size = int64_t(buf.st_size);
+    return (const char *)ptr;
+  }
+
+  static void FS_MUNMAP(const char * ptr, int64_t size)
+  {
+    if (ptr)
+      munmap((void *)ptr, size_t(size));
+  }
+
+  static bool FS_FTRUNCATE(FILE * f, int64_t size)
+  {
+    fflush(f);
+    return ftruncate(fileno(f), off_t(size)) == 0;
+  }
+
+  // flushes 'f' and waits until its data is on disk
+  static bool FS_FSYNC(FILE * f)
+  {
+    return fflush(f) == 0 && fsync(fileno(f)) == 0;
+  }
+
+  // reserves disk space and extends the file to 'size' bytes
+  static bool FS_PREALLOCATE(FILE * f, int64_t size)
+  {
+    fflush(f);
+    struct stat buf;
+    if (fstat(fileno(f), &buf) != 0 || size <= buf.st_size)
+      return false;
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, off_t(size - buf.st_size), 0 };
+    if (fcntl(fileno(f), F_PREALLOCATE, &store) == -1)
+    {
+      store.fst_flags = F_ALLOCATEALL;
+      if (fcntl(fileno(f), F_PREALLOCATE, &store) == -1)
+        return false;
+    }
+    return ftruncate(fileno(f), off_t(size)) == 0;
+  }
+
+  static bool FS_PREAD(FILE * f, void * buffer, size_t size, int64_t offset)
   {
-    rename(file_from_utf8, file_dest_utf8);
+    char * dst = (char *)buffer;
+    while (size > 0)
+    {
+      ssize_t bytesRead = pread(fileno(f), dst, size, off_t(offset));
+      if (bytesRead < 0 && errno == EINTR)
+        continue;
+      if (bytesRead <= 0)
+        return false;
+      dst += bytesRead;
+      size -= size_t(bytesRead);
+      offset += bytesRead;
+    }
+    return true;
   }
 
 #else // linux
@@ -168,9 +331,64 @@ string get_absolute_file_name(const char * file_name_utf8)
     unlink(file_name_utf8);
   }
 
-  void FS_RENAME(const char * file_from_utf8, const char * file_dest_utf8)
+  // atomically replaces 'file_dest_utf8' if it exists
+  bool FS_RENAME(const char * file_from_utf8, const char * file_dest_utf8)
+  {
+    return rename(file_from_utf8, file_dest_utf8) == 0;
+  }
+
+  static const char * FS_MMAP(FILE * f, int64_t & size)
+  {
+    size = 0;
+    struct stat buf;
+    if (fstat(fileno(f), &buf) != 0 || buf.st_size <= 0)
+      return nullptr;
+    void * ptr = mmap(nullptr, size_t(buf.st_size), PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (ptr == MAP_FAILED)
+      return nullptr;
+    size = int64_t(buf.st_size);
+    return (const char *)ptr;
+  }
+
+  static void FS_MUNMAP(const char * ptr, int64_t size)
+  {
+    if (ptr)
+      munmap((void *)ptr, size_t(size));
+  }
+
+  static bool FS_FTRUNCATE(FILE * f, int64_t size)
+  {
+    fflush(f);
+    return ftruncate(fileno(f), off_t(size)) == 0;
+  }
+
+  // flushes 'f' and waits until its data is on disk
+  static bool FS_FSYNC(FILE * f)
+  {
+    return fflush(f) == 0 && fsync(fileno(f)) == 0;
+  }
+
+  // reserves disk space and extends the file to 'size' bytes
+  static bool FS_PREALLOCATE(FILE * f, int64_t size)
+  {
+    return fallocate64(fileno(f), 0, 0, off64_t(size)) == 0;
+  }
+
+  static bool FS_PREAD(FILE * f, void * buffer, size_t size, int64_t offset)
   {
-    rename(file_from_utf8, file_dest_utf8);
+    char * dst = (char *)buffer;
+    while (size > 0)
+    {
+      ssize_t bytesRead = pread64(fileno(f), dst, size, off64_t(offset));
+      if (bytesRead < 0 && errno == EINTR)
+        continue;
+      if (bytesRead <= 0)
+        return false;
+      dst += bytesRead;
+      size -= size_t(bytesRead);
+      offset += bytesRead;
+    }
+    return true;
   }
 
 #endif
@@ -218,41 +436,92 @@ struct ZstdDecompressContext
 static thread_local ZstdCompressContext zstd_compress_context;
 static thread_local ZstdDecompressContext zstd_decompress_context;
 static recursive_mutex partitions_lock;
+static atomic<uint64_t> file_tables_generation = { 0 }; // incremented when a partition gets a new file table
+
+
+enum Fs8EntryFlags
+{
+  FS8_ENTRY_STORED = 1,  // raw bytes, compressedSize == decompressedSize
+  FS8_ENTRY_CHUNKED = 2, // starts with Fs8ChunkTable, followed by independent zstd frames of chunkSize bytes each
+  FS8_ENTRY_IN_BLOCK = 4, // part of a solid block: offsetInFile and compressedSize describe the block,
+                          // the file is at offsetInBlock in the decompressed block (FS8_SECTION_BLOCK_OFFSETS)
+  FS8_ENTRY_KNOWN_FLAGS = FS8_ENTRY_STORED | FS8_ENTRY_CHUNKED | FS8_ENTRY_IN_BLOCK, // an entry with other bits is corrupted
+};
+
+#define FS_CHUNK_TABLE_MAGIC 0x43385346 // "FS8C"
+
+// Jump table of a chunked entry. It is a zstd skippable frame, so the whole entry is still a valid
+// sequence of zstd frames and is decompressed at once by the readers that do not look at it.
+// Followed by uint64_t frameOffsets[chunkCount + 1] from the start of the entry (the last one == compressedSize).
+struct Fs8ChunkTable
+{
+  uint32_t skippableMagic; // ZSTD_MAGIC_SKIPPABLE_START
+  uint32_t frameSize;      // size of the skippable frame after this field
+  uint32_t magic;          // FS_CHUNK_TABLE_MAGIC
+  uint32_t chunkCount;
+  uint64_t chunkSize;      // decompressed size of every chunk except the last one
+};
+
+static int64_t chunk_table_size(int64_t chunk_count)
+{
+  return int64_t(sizeof(Fs8ChunkTable)) + (chunk_count + 1) * int64_t(sizeof(uint64_t));
+}
+
+// 0 - the file is not split
+static int64_t get_chunk_count(int64_t file_size, int64_t chunk_size)
+{
+  if (chunk_size <= 0 || file_size <= chunk_size)
+    return 0;
+  int64_t count = (file_size + chunk_size - 1) / chunk_size;
+  return count < (1 << 24) ? count : 0; // keeps the table within a skippable frame
+}
 
+static void init_chunk_table(Fs8ChunkTable & table, int64_t chunk_count, int64_t chunk_size)
+{
+  table.skippableMagic = ZSTD_MAGIC_SKIPPABLE_START;
+  table.frameSize = uint32_t(chunk_table_size(chunk_count) - 8);
+  table.magic = FS_CHUNK_TABLE_MAGIC;
+  table.chunkCount = uint32_t(chunk_count);
+  table.chunkSize = uint64_t(chunk_size);
+}
 
 struct Fs8FileInfo
 {
-  // only these 3 fields will be saved to the .fs8
+  // only these 3 fields will be saved to the .fs8 (flags are packed into the top byte of offsetInFile)
   //////////////////////////////////
   int64_t offsetInFile = 0;
   int64_t compressedSize = 0;
   int64_t decompressedSize = 0;
   //////////////////////////////////
+  uint32_t flags = 0;
+  int64_t offsetInBlock = 0;  // FS8_ENTRY_IN_BLOCK
+  uint64_t contentHash = 0;   // hash_content() of the decompressed file (FS8_SECTION_CONTENT_HASHES), 0 - unknown
+  int64_t entryIndex = -1;    // in the file table, -1 - not read from a table
 
-  void resetPtr()
+  bool isStored() const
   {
-    decompressedPtr = nullptr;
+    return (flags & FS8_ENTRY_STORED) != 0;
   }
 
-  void * getDecompressedPtr()
+  bool isChunked() const
   {
-    return decompressedPtr;
+    return (flags & FS8_ENTRY_CHUNKED) != 0;
   }
 
-  void setDecompressedPtr(void * ptr)
+  bool isInBlock() const
   {
-    decompressedPtr = ptr;
+    return (flags & FS8_ENTRY_IN_BLOCK) != 0;
   }
-
-private:
-  void * decompressedPtr = nullptr;
 };
 
 using FileInfosMap = unordered_map<string, Fs8FileInfo>;
 
-static void append_bytes(vector<char> & bytes, const void * ptr, size_t size)
+// pads the file with zeros up to a multiple of 8 bytes
+static bool write_alignment(FILE * f)
 {
-  bytes.insert(bytes.end(), (const char *)ptr, (const char *)ptr + size);
+  static const char zeros[8] = {};
+  int64_t pos = FS_FTELL(f);
+  return pos >= 0 && (pos % 8 == 0 || fwrite(zeros, size_t(8 - pos % 8), 1, f) == 1);
 }
 
 static bool read_bytes(const char ** cursor, int & bytes_left, void * ptr, size_t size)
@@ -267,1073 +536,5373 @@ static bool read_bytes(const char ** cursor, int & bytes_left, void * ptr, size_
 }
 
 
-// 4 size of serialized file infos - 4
-// [
-//    2  name length
-//    ?  lower case name without \0
-//    ?  Fs8FileInfo
-// ]
-
-int serialize_fs_file_infos(const FileInfosMap & fs_file_infos, vector<char> & bytes)
+// ASCII letters are lowered regardless of the C locale, so the packer and the readers always agree
+static inline char normalize_char(char ch)
 {
-  unordered_set<string> allNames;
-  bool hasDuplicates = false;
+  if (ch >= 'A' && ch <= 'Z')
+    return char(ch + ('a' - 'A'));
+  return ch == '\\' ? '/' : ch;
+}
 
-  bytes.clear();
-  bytes.resize(sizeof(uint32_t));
-  for (auto & f : fs_file_infos)
-  {
-    string lowerCaseName = f.first;
-    for (auto & ch : lowerCaseName)
-    {
-      ch = tolower(ch);
-      if (ch == '\\')
-        ch = '/';
-    }
+// normalize_char() of 8 bytes at once
+static inline uint64_t normalize_word(uint64_t w)
+{
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t low7 = 0x7F * ones;
+  const uint64_t high = 0x80 * ones;
+
+  // the high bit of a byte is set for 'A'..'Z' (bytes >= 0x80 are excluded by ~w)
+  uint64_t b = w & low7;
+  uint64_t upper = (b + (0x80 - 'A') * ones) & ~(b + (0x7F - 'Z') * ones) & ~w & high;
+  w |= upper >> 2; // 0x80 >> 2 == 'a' - 'A'
+
+  // the high bit of a byte is set for '\\'
+  uint64_t x = w ^ ('\\' * ones);
+  uint64_t backslash = ~(((x & low7) + low7) | x) & high;
+  return w ^ ((backslash >> 7) * ('\\' ^ '/'));
+}
 
-    if (allNames.find(lowerCaseName) != allNames.end())
-    {
-      Fs8FileSystem::errorLogCallback((string("Duplicate file name: ") + lowerCaseName).c_str());
-      hasDuplicates = true;
-    }
-    else
-      allNames.insert(lowerCaseName);
+static void normalize_file_name(string & name)
+{
+  for (char & ch : name)
+    ch = normalize_char(ch);
+}
 
-    int16_t fileNameLength = int16_t(lowerCaseName.length());
-    append_bytes(bytes, &fileNameLength, sizeof(fileNameLength));
-    append_bytes(bytes, lowerCaseName.c_str(), lowerCaseName.length());
-    append_bytes(bytes, &f.second, sizeof(int64_t) * 3);
+// 'normalized' equals 'name' after normalize_file_name()
+static bool equals_normalized(const char * normalized, const char * name, size_t length)
+{
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t a, b;
+    memcpy(&a, normalized + i, 8);
+    memcpy(&b, name + i, 8);
+    if (a != normalize_word(b))
+      return false;
   }
-
-  uint32_t size = uint32_t(bytes.size()) - 4;
-  memcpy(&bytes[0], &size, sizeof(size));
-
-  return int(bytes.size()) && !hasDuplicates;
+  for (; i < length; i++)
+    if (normalized[i] != normalize_char(name[i]))
+      return false;
+  return true;
 }
 
 
+// version 1 and 2 file table:
+// 4 size of serialized file infos - 4
+// [
+//    2  name length
+//    ?  lower case name without \0
+//    ?  Fs8FileInfo (version 2: flags << FS_ENTRY_FLAGS_SHIFT | offsetInFile)
+// ]
+
 
-int64_t check_header_get_file_names_offset(const char buf[24])
+// version 3 file table, used in place: no parsing and no per-file allocations when the archive is opened
+//
+//   Fs8IndexHeader
+//   uint64_t slots[slotCount]                 open addressing hash table (linear probing),
+//                                             (name hash >> 32) << 32 | (entry index + 1), 0 - empty slot
+//   int64_t  offsets[entryCount]              offsetInFile
+//   int64_t  compressedSizes[entryCount]
+//   int64_t  decompressedSizes[entryCount]
+//   uint32_t flags[entryCount]                Fs8EntryFlags
+//   uint32_t nameOffsets[entryCount + 1]      name of entry i is names[nameOffsets[i] .. nameOffsets[i + 1])
+//   char     names[namesSize]                 lower case names without \0, entries are sorted by name
+//   Fs8IndexSection sections[sectionCount]    optional data, readers skip unknown sections
+//
+// all offsets are relative to the beginning of the table, every array is 8-byte aligned
+
+struct Fs8IndexHeader
 {
-  if (strncmp(buf, "FS8.", 4) != 0)
-    return 0;
+  char magic[4];             // "FS8I"
+  uint32_t headerSize;
+  uint64_t tableSize;
+  uint32_t entryCount;
+  uint32_t slotCount;        // power of 2
+  uint32_t namesSize;
+  uint32_t sectionCount;
+  uint64_t slotsOffset;
+  uint64_t offsetsOffset;
+  uint64_t compressedSizesOffset;
+  uint64_t decompressedSizesOffset;
+  uint64_t flagsOffset;
+  uint64_t nameOffsetsOffset;
+  uint64_t namesOffset;
+  uint64_t sectionsOffset;
+};
 
-  char version[] = "....";
-  memcpy(version, buf + 4, 4);
-  int v = atoi(version);
-  if (v != 1)
-    return 0;
+struct Fs8IndexSection
+{
+  uint32_t id;               // Fs8IndexSectionId
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+};
 
-  int64_t fileNamesOffset = 0;
-  memcpy(&fileNamesOffset, buf + 8, sizeof(fileNamesOffset));
+enum Fs8IndexSectionId
+{
+  FS8_SECTION_DICTIONARIES = 1,  // zstd dictionaries, frames name their dictionary by its ID
+  FS8_SECTION_BLOCK_OFFSETS = 2, // int64_t offsetInBlock[entryCount], used by FS8_ENTRY_IN_BLOCK entries
+  FS8_SECTION_CONTENT_HASHES = 3, // uint64_t contentHash[entryCount], lets updates skip unchanged files
+};
 
-  return fileNamesOffset;
-}
+// FS8_SECTION_DICTIONARIES:
+//   uint32_t count
+//   uint32_t reserved
+//   uint64_t sizes[count]
+//   dictionaries, each one is 8-byte aligned
 
-int64_t check_header_get_sign_offset(const char buf[24])
+struct Fs8IndexSectionData
 {
-  if (strncmp(buf, "FS8.", 4) != 0)
-    return 0;
+  uint32_t id = 0;
+  vector<char> bytes;
+};
 
-  int64_t signaturesOffset = 0;
-  memcpy(&signaturesOffset, buf + 8 + 8, sizeof(signaturesOffset));
 
-  return signaturesOffset;
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
 }
 
+// hash of the normalized (lower case, '/' separated) name, stored in the version 3 file table,
+// 'normalize' - the name is normalized on the fly, the hash is the same as of the normalized copy
+static uint64_t hash_file_name(const char * name, size_t length, bool normalize = false)
+{
+  const uint64_t k1 = 0x9E3779B97F4A7C15ull;
+  const uint64_t k2 = 0xC2B2AE3D27D4EB4Full;
+  uint64_t h = uint64_t(length) * k1;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t w;
+    memcpy(&w, name + i, 8);
+    if (normalize)
+      w = normalize_word(w);
+    h = rotl64(h ^ (w * k2), 31) * k1;
+  }
+
+  uint64_t w = 0;
+  memcpy(&w, name + i, length - i);
+  if (normalize)
+    w = normalize_word(w);
+  h = rotl64(h ^ (w * k2), 31) * k1;
+
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  h ^= h >> 33;
+  return h;
+}
 
-const char * read_whole_file(const char * file_name_utf8, size_t & size)
+// XXH64 of file contents, the four lanes are independent so the main loop vectorizes and pipelines well
+struct Fs8ContentHasher
 {
-  size = 0;
-  if (!file_name_utf8)
-    return nullptr;
-  FILE * f = FS_FOPEN(file_name_utf8, "rb");
-  if (!f)
-    return nullptr;
+  static const uint64_t P1 = 0x9E3779B185EBCA87ull;
+  static const uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+  static const uint64_t P3 = 0x165667B19E3779F9ull;
+  static const uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+  static const uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+  uint64_t seed = 0;
+  uint64_t lanes[4];
+  uint64_t totalSize = 0;
+  unsigned char tail[32];
+  size_t tailSize = 0;
+
+  explicit Fs8ContentHasher(uint64_t seed_ = 0) : seed(seed_)
+  {
+    lanes[0] = seed + P1 + P2;
+    lanes[1] = seed + P2;
+    lanes[2] = seed;
+    lanes[3] = seed - P1;
+  }
 
-  if (FS_FSEEK(f, 0, SEEK_END) != 0)
+  static inline uint64_t round(uint64_t acc, uint64_t input)
   {
-    fclose(f);
-    return nullptr;
+    return rotl64(acc + input * P2, 31) * P1;
   }
 
-  size = FS_FTELL(f);
+  static inline uint64_t load64(const unsigned char * p)
+  {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+  }
 
-  if (FS_FSEEK(f, 0, SEEK_SET) != 0)
+  void consume(const unsigned char * p, size_t stripes)
   {
-    fclose(f);
-    size = 0;
-    return nullptr;
+    uint64_t v0 = lanes[0], v1 = lanes[1], v2 = lanes[2], v3 = lanes[3];
+    for (size_t i = 0; i < stripes; i++, p += 32)
+    {
+      v0 = round(v0, load64(p));
+      v1 = round(v1, load64(p + 8));
+      v2 = round(v2, load64(p + 16));
+      v3 = round(v3, load64(p + 24));
+    }
+    lanes[0] = v0;
+    lanes[1] = v1;
+    lanes[2] = v2;
+    lanes[3] = v3;
   }
 
-  char * data = new char[size];
-  if (size > 0)
-    if (fread(data, size, 1, f) != 1)
+  void update(const void * data, size_t size)
+  {
+    const unsigned char * p = (const unsigned char *)data;
+    totalSize += size;
+
+    if (tailSize > 0)
     {
-      delete[] data;
-      size = 0;
-      fclose(f);
-      return nullptr;
+      size_t n = min(size, 32 - tailSize);
+      memcpy(tail + tailSize, p, n);
+      tailSize += n;
+      p += n;
+      size -= n;
+      if (tailSize < 32)
+        return;
+      consume(tail, 1);
+      tailSize = 0;
     }
 
-  fclose(f);
-  return data;
-}
+    consume(p, size / 32);
+    p += size / 32 * 32;
+    tailSize = size % 32;
+    if (tailSize > 0)
+      memcpy(tail, p, tailSize);
+  }
+
+  uint64_t digest() const
+  {
+    uint64_t h = 0;
+    if (totalSize >= 32)
+    {
+      h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+      for (int i = 0; i < 4; i++)
+        h = (h ^ round(0, lanes[i])) * P1 + P4;
+    }
+    else
+      h = seed + P5;
 
+    h += totalSize;
 
-static void fhash_block(uint32_t * block, int size_in_bytes, uint32_t & hash)
+    const unsigned char * p = tail;
+    size_t left = tailSize;
+    for (; left >= 8; left -= 8, p += 8)
+      h = rotl64(h ^ round(0, load64(p)), 27) * P1 + P4;
+    if (left >= 4)
+    {
+      uint32_t v;
+      memcpy(&v, p, 4);
+      h = rotl64(h ^ (uint64_t(v) * P1), 23) * P2 + P3;
+      left -= 4;
+      p += 4;
+    }
+    for (; left > 0; left--, p++)
+      h = rotl64(h ^ (*p * P5), 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+  }
+};
+
+static uint64_t hash_content(const void * data, size_t size)
 {
-  uint32_t res = hash;
-  int size = size_in_bytes / sizeof(uint32_t);
-  for (int i = 0; i < size; i++)
-    res += block[i] + res * 33 + 1 + (res >> 6);
-  hash = res;
+  Fs8ContentHasher hasher;
+  hasher.update(data, size);
+  return hasher.digest();
 }
 
-bool sign_file_fhash(const string & file_name_utf8)
+template <typename T>
+static inline T load_at(const char * base, uint64_t offset, size_t index)
 {
-  vector<char> data(65536 * 2);
-  FILE * f = FS_FOPEN(file_name_utf8.c_str(), "rb+");
-  if (!f)
-    return false;
-
-  uint32_t hash = 0;
-  size_t readBytes = 0;
-
-  while ((readBytes = fread(&data[0], 1, data.size(), f)) > 0)
-    fhash_block((uint32_t *)&data[0], int(readBytes), hash);
-
-  uint32_t signSize = 4 + 4 + 4;
-  uint32_t signType = 1;
-  fwrite(&signSize, 4, 1, f);
-  fwrite(&signType, 4, 1, f);
-  if (fwrite(&hash, 4, 1, f) != 1)
-  {
-    fclose(f);
-    return false;
-  }
-  fclose(f);
-  return true;
+  T v;
+  memcpy(&v, base + offset + index * sizeof(T), sizeof(T));
+  return v;
 }
 
-bool convert_file_to_hex32(const string & file_name_utf8)
+static inline uint64_t align8(uint64_t x)
 {
-  vector<char> data(65536);
-  FILE * f = FS_FOPEN(file_name_utf8.c_str(), "rb");
-  if (!f)
-    return false;
+  return (x + 7) & ~uint64_t(7);
+}
 
-  FILE * hexf = FS_FOPEN((file_name_utf8 + ".hex.tmp").c_str(), "wt");
-  if (!hexf)
-    return false;
 
-  uint32_t hash = 0;
-  size_t readBytes = 0;
+// read-only view of a version 3 file table, the bytes are owned by the caller
+struct Fs8Index
+{
+  const char * base = nullptr;
+  Fs8IndexHeader header = {};
+  uint64_t blockOffsetsOffset = 0; // 0 - no solid blocks
+  uint64_t contentHashesOffset = 0; // 0 - the archive has no content hashes
 
-  while ((readBytes = fread(&data[0], 1, data.size(), f)) > 0)
+  // O(1), only the header is checked, entries are checked when they are used
+  bool init(const char * table, uint64_t size)
   {
-    readBytes = int(((readBytes - 1) | (sizeof(uint32_t) - 1)) + 1);
-    int cnt = int(readBytes / sizeof(uint32_t));
-    const uint32_t * p = (const uint32_t *)&data[0];
-    for (int i = 0; i < cnt; i++, p++)
-    {
-      fprintf(hexf, "0x%X,", *p);
-      if ((i & 15) == 15 || (*p & 0xFF) == '.')
-        fprintf(hexf, "\n");
-    }
-  }
+    base = nullptr;
+    if (size < sizeof(Fs8IndexHeader))
+      return false;
+    memcpy(&header, table, sizeof(header));
+
+    uint64_t n = header.entryCount;
+    if (memcmp(header.magic, "FS8I", 4) != 0 || header.headerSize < sizeof(Fs8IndexHeader) || header.tableSize > size ||
+      header.slotCount == 0 || (header.slotCount & (header.slotCount - 1)) != 0 || header.slotCount < n ||
+      !fits(header.slotsOffset, uint64_t(header.slotCount) * 8) ||
+      !fits(header.offsetsOffset, n * 8) ||
+      !fits(header.compressedSizesOffset, n * 8) ||
+      !fits(header.decompressedSizesOffset, n * 8) ||
+      !fits(header.flagsOffset, n * 4) ||
+      !fits(header.nameOffsetsOffset, (n + 1) * 4) ||
+      !fits(header.namesOffset, header.namesSize) ||
+      !fits(header.sectionsOffset, uint64_t(header.sectionCount) * sizeof(Fs8IndexSection)))
+      return false;
 
-  fclose(hexf);
-  fclose(f);
+    base = table;
 
-  FS_UNLINK(file_name_utf8.c_str());
-  FS_RENAME((file_name_utf8 + ".hex.tmp").c_str(), file_name_utf8.c_str());
+    const char * blockOffsets = nullptr;
+    uint64_t blockOffsetsSize = 0;
+    blockOffsetsOffset = 0;
+    if (section(FS8_SECTION_BLOCK_OFFSETS, blockOffsets, blockOffsetsSize) && blockOffsetsSize >= n * 8)
+      blockOffsetsOffset = uint64_t(blockOffsets - base);
 
-  return true;
-}
+    const char * contentHashes = nullptr;
+    uint64_t contentHashesSize = 0;
+    contentHashesOffset = 0;
+    if (section(FS8_SECTION_CONTENT_HASHES, contentHashes, contentHashesSize) && contentHashesSize >= n * 8)
+      contentHashesOffset = uint64_t(contentHashes - base);
+    return true;
+  }
 
+  bool fits(uint64_t offset, uint64_t bytes) const
+  {
+    return offset >= header.headerSize && offset <= header.tableSize && bytes <= header.tableSize - offset;
+  }
 
-struct Fs8Partition
-{
-  bool isInMemory = false;
-  string fileName;
-  FILE * fileDescriptor = nullptr;
-  uint64_t fileTime = 0;
-  chrono::time_point<chrono::steady_clock> lastAccessTime;
+  size_t size() const
+  {
+    return base ? header.entryCount : 0;
+  }
 
-  const char * inMemoryDataPtr = nullptr;
-  int64_t inMemorySize = 0;
-  int useCount = 0;
-  FileInfosMap fileInfos;
-  recursive_mutex decompression_lock;
+  bool entryName(size_t index, const char *& name, size_t & length) const
+  {
+    uint32_t from = load_at<uint32_t>(base, header.nameOffsetsOffset, index);
+    uint32_t to = load_at<uint32_t>(base, header.nameOffsetsOffset, index + 1);
+    if (from > to || to > header.namesSize)
+      return false;
+    name = base + header.namesOffset + from;
+    length = to - from;
+    return true;
+  }
 
-  ~Fs8Partition()
+  // the first section with this id
+  bool section(uint32_t id, const char *& data, uint64_t & size) const
   {
-    lock_guard<recursive_mutex> lock(decompression_lock);
-    for (auto inf : fileInfos)
+    for (uint32_t i = 0; base && i < header.sectionCount; i++)
     {
-      char * decompressedFile = (char *)inf.second.getDecompressedPtr();
-      if (decompressedFile)
+      Fs8IndexSection s = load_at<Fs8IndexSection>(base, header.sectionsOffset, i);
+      if (s.id == id && fits(s.offset, s.size))
       {
-        delete[] decompressedFile;
-        inf.second.resetPtr();
+        data = base + s.offset;
+        size = s.size;
+        return true;
       }
     }
-
-    if (fileDescriptor)
-      fclose(fileDescriptor);
+    return false;
   }
-};
 
-
-
-static struct PartitionsContainer
-{
-  vector<Fs8Partition *> partitions;
-
-  ~PartitionsContainer()
+  // false - the entry has unknown flags, it cannot be read
+  bool entryInfo(size_t index, Fs8FileInfo & info) const
   {
-    lock_guard<recursive_mutex> lock(partitions_lock);
-
-    for (auto & p : partitions)
+    info.offsetInFile = load_at<int64_t>(base, header.offsetsOffset, index);
+    info.compressedSize = load_at<int64_t>(base, header.compressedSizesOffset, index);
+    info.decompressedSize = load_at<int64_t>(base, header.decompressedSizesOffset, index);
+    info.flags = load_at<uint32_t>(base, header.flagsOffset, index);
+    info.offsetInBlock = 0;
+    info.contentHash = contentHashesOffset ? load_at<uint64_t>(base, contentHashesOffset, index) : 0;
+    info.entryIndex = int64_t(index);
+
+    if (info.isInBlock())
     {
+      info.offsetInBlock = blockOffsetsOffset ? load_at<int64_t>(base, blockOffsetsOffset, index) : -1;
+      if (info.isStored())
       {
-        lock_guard<recursive_mutex> lock(p->decompression_lock);
-        for (auto & info : p->fileInfos)
-        {
-          char * ptr = (char *)info.second.getDecompressedPtr();
-          if (ptr)
-          {
-            delete[] ptr;
-            info.second.resetPtr();
-          }
-        }
+        // a stored block is plain bytes, its files are read as ordinary stored files
+        bool valid = info.offsetInBlock >= 0 && info.decompressedSize >= 0 &&
+          info.offsetInBlock <= info.compressedSize - info.decompressedSize;
+        info.offsetInFile = valid ? info.offsetInFile + info.offsetInBlock : 0;
+        info.compressedSize = info.decompressedSize;
+        info.offsetInBlock = 0;
+        info.flags &= ~uint32_t(FS8_ENTRY_IN_BLOCK);
       }
-      delete p;
-      p = nullptr;
     }
-    partitions.clear();
+    return (info.flags & ~uint32_t(FS8_ENTRY_KNOWN_FLAGS)) == 0;
   }
 
-
-  bool deserializeFileInfos(FileInfosMap & fs_file_infos, const vector<char> & bytes)
+  // index of the entry or -1, 'name' must be normalized
+  int64_t find(const char * name, size_t length) const
   {
-    fs_file_infos.clear();
-    if (bytes.empty())
-      return false;
-    const char * cursor = &bytes[4]; // skip size
-    int bytes_left = int(bytes.size()) - 4;
-
-    uint16_t fileNameLength = 0;
+    return find(name, length, hash_file_name(name, length), true);
+  }
 
-    while (bytes_left > 0)
+  // 'hash' - hash_file_name() of the normalized name, 'name_is_normalized' false - 'name' is compared
+  // as normalize_file_name() would change it
+  int64_t find(const char * name, size_t length, uint64_t hash, bool name_is_normalized) const
+  {
+    if (!base)
+      return -1;
+    uint32_t tag = uint32_t(hash >> 32);
+    uint32_t mask = header.slotCount - 1;
+    for (uint32_t i = 0, pos = uint32_t(hash) & mask; i < header.slotCount; i++, pos = (pos + 1) & mask)
     {
-      if (!read_bytes(&cursor, bytes_left, &fileNameLength, sizeof(fileNameLength)))
-      {
-        Fs8FileSystem::errorLogCallback("Corrupted file (cannot read fileNameLength)");
-        return false;
-      }
+      uint64_t slot = load_at<uint64_t>(base, header.slotsOffset, pos);
+      if (slot == 0)
+        return -1;
+      uint32_t entry = uint32_t(slot) - 1;
+      const char * entryNamePtr = nullptr;
+      size_t entryLength = 0;
+      if (uint32_t(slot >> 32) == tag && entry < header.entryCount && entryName(entry, entryNamePtr, entryLength) &&
+        entryLength == length && (name_is_normalized ? memcmp(entryNamePtr, name, length) == 0 :
+          equals_normalized(entryNamePtr, name, length)))
+        return entry;
+    }
+    return -1;
+  }
+};
 
-      if (fileNameLength > 512)
-      {
-        Fs8FileSystem::errorLogCallback("Corrupted file (fileNameLength > 512)");
-        return false;
-      }
 
-      string s;
-      s.resize(fileNameLength);
+struct Fs8IndexBuilderEntry
+{
+  uint32_t nameOffset = 0; // in the names arena
+  uint32_t nameLength = 0;
+  Fs8FileInfo info;
+};
 
-      if (!read_bytes(&cursor, bytes_left, &s[0], fileNameLength))
-      {
-        Fs8FileSystem::errorLogCallback("Corrupted file (cannot read fileName)");
-        return false;
-      }
+// 'names' - arena of normalized names, the order of entries does not matter
+static bool build_fs_index(const string & names, vector<Fs8IndexBuilderEntry> & entries,
+  const vector<Fs8IndexSectionData> & sections_, vector<char> & bytes)
+{
+  vector<Fs8IndexSectionData> sections = sections_;
+  const char * arena = names.data();
+  auto entryName = [arena](const Fs8IndexBuilderEntry & e) { return string_view(arena + e.nameOffset, e.nameLength); };
 
-      Fs8FileInfo fileInfo;
+  sort(entries.begin(), entries.end(), [&](const Fs8IndexBuilderEntry & a, const Fs8IndexBuilderEntry & b)
+    { return entryName(a) < entryName(b); });
 
-      if (!read_bytes(&cursor, bytes_left, &fileInfo, sizeof(int64_t) * 3))
-      {
-        Fs8FileSystem::errorLogCallback("Corrupted file (cannot read fileInfo)");
-        return false;
-      }
+  bool hasDuplicates = false;
+  uint64_t namesSize = 0;
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    if (i > 0 && entryName(entries[i]) == entryName(entries[i - 1]))
+    {
+      Fs8FileSystem::errorLogCallback((string("Duplicate file name: ") + string(entryName(entries[i]))).c_str());
+      hasDuplicates = true;
+    }
+    namesSize += entries[i].nameLength;
+  }
 
-      fileInfo.resetPtr();
+  uint64_t n = entries.size();
+  if (hasDuplicates || n >= UINT32_MAX / 4 || namesSize >= UINT32_MAX)
+    return false;
 
-      fs_file_infos[s] = fileInfo;
-    }
+  uint32_t slotCount = 4;
+  while (slotCount < n * 2)
+    slotCount *= 2;
 
-    return bytes_left == 0;
+  bool hasBlocks = false;
+  for (auto & e : entries)
+    hasBlocks = hasBlocks || e.info.isInBlock();
+
+  if (hasBlocks)
+  {
+    Fs8IndexSectionData blockOffsets;
+    blockOffsets.id = FS8_SECTION_BLOCK_OFFSETS;
+    blockOffsets.bytes.resize(size_t(n * 8));
+    for (size_t i = 0; i < entries.size(); i++)
+      memcpy(&blockOffsets.bytes[i * 8], &entries[i].info.offsetInBlock, 8);
+    sections.push_back(move(blockOffsets));
   }
 
+  bool hasContentHashes = false;
+  for (auto & e : entries)
+    hasContentHashes = hasContentHashes || e.info.contentHash != 0;
 
+  if (hasContentHashes)
+  {
+    Fs8IndexSectionData contentHashes;
+    contentHashes.id = FS8_SECTION_CONTENT_HASHES;
+    contentHashes.bytes.resize(size_t(n * 8));
+    for (size_t i = 0; i < entries.size(); i++)
+      memcpy(&contentHashes.bytes[i * 8], &entries[i].info.contentHash, 8);
+    sections.push_back(move(contentHashes));
+  }
 
-  // will increment use counter
-  Fs8Partition * findOrInitializePartitionFn(const char * fs8_file_name_utf8)
+  Fs8IndexHeader header = {};
+  memcpy(header.magic, "FS8I", 4);
+  header.headerSize = sizeof(Fs8IndexHeader);
+  header.entryCount = uint32_t(n);
+  header.slotCount = slotCount;
+  header.namesSize = uint32_t(namesSize);
+  header.sectionCount = uint32_t(sections.size());
+  header.slotsOffset = align8(sizeof(Fs8IndexHeader));
+  header.offsetsOffset = align8(header.slotsOffset + uint64_t(slotCount) * 8);
+  header.compressedSizesOffset = align8(header.offsetsOffset + n * 8);
+  header.decompressedSizesOffset = align8(header.compressedSizesOffset + n * 8);
+  header.flagsOffset = align8(header.decompressedSizesOffset + n * 8);
+  header.nameOffsetsOffset = align8(header.flagsOffset + n * 4);
+  header.namesOffset = align8(header.nameOffsetsOffset + (n + 1) * 4);
+  header.sectionsOffset = align8(header.namesOffset + namesSize);
+  header.tableSize = align8(header.sectionsOffset + sections.size() * sizeof(Fs8IndexSection));
+
+  vector<Fs8IndexSection> sectionHeaders(sections.size());
+  for (size_t i = 0; i < sections.size(); i++)
   {
-    if (!fs8_file_name_utf8 || !fs8_file_name_utf8[0])
-    {
-      Fs8FileSystem::errorLogCallback("Empty file name");
-      return nullptr;
-    }
+    sectionHeaders[i].id = sections[i].id;
+    sectionHeaders[i].reserved = 0;
+    sectionHeaders[i].offset = header.tableSize;
+    sectionHeaders[i].size = sections[i].bytes.size();
+    header.tableSize = align8(header.tableSize + sections[i].bytes.size());
+  }
 
-    lock_guard<recursive_mutex> lock(partitions_lock);
+  bytes.assign(size_t(header.tableSize), 0);
+  bytes.shrink_to_fit();
+  char * base = &bytes[0];
+  memcpy(base, &header, sizeof(header));
 
-    Fs8Partition * recreatePartition = nullptr;
+  uint64_t * slots = (uint64_t *)(base + header.slotsOffset);
+  uint32_t nameOffset = 0;
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    const char * name = arena + entries[i].nameOffset;
+    uint32_t length = entries[i].nameLength;
+    const Fs8FileInfo & info = entries[i].info;
+    memcpy(base + header.offsetsOffset + i * 8, &info.offsetInFile, 8);
+    memcpy(base + header.compressedSizesOffset + i * 8, &info.compressedSize, 8);
+    memcpy(base + header.decompressedSizesOffset + i * 8, &info.decompressedSize, 8);
+    memcpy(base + header.flagsOffset + i * 4, &info.flags, 4);
+    memcpy(base + header.nameOffsetsOffset + i * 4, &nameOffset, 4);
+    memcpy(base + header.namesOffset + nameOffset, name, length);
+    nameOffset += length;
+
+    uint64_t hash = hash_file_name(name, length);
+    uint32_t pos = uint32_t(hash) & (slotCount - 1);
+    while (slots[pos] != 0)
+      pos = (pos + 1) & (slotCount - 1);
+    slots[pos] = (uint64_t(uint32_t(hash >> 32)) << 32) | uint64_t(i + 1);
+  }
+  memcpy(base + header.nameOffsetsOffset + n * 4, &nameOffset, 4);
 
-    string fname = fs8_file_name_utf8;
-    for (Fs8Partition * p : partitions)
-      if (fname == p->fileName)
-      {
-        if (!p->fileDescriptor)
-        {
-          uint64_t curFileTime = get_file_time(fs8_file_name_utf8);
-          if (p->fileTime != curFileTime)
-          {
-            recreatePartition = p;
-            break;
-          }
+  for (size_t i = 0; i < sections.size(); i++)
+  {
+    memcpy(base + header.sectionsOffset + i * sizeof(Fs8IndexSection), &sectionHeaders[i], sizeof(Fs8IndexSection));
+    if (!sections[i].bytes.empty())
+      memcpy(base + sectionHeaders[i].offset, &sections[i].bytes[0], sections[i].bytes.size());
+  }
 
-          p->fileDescriptor = FS_FOPEN(fs8_file_name_utf8, "rb");
-          if (!p->fileDescriptor)
-          {
-            Fs8FileSystem::errorLogCallback((string("Cannot open file ") + fs8_file_name_utf8).c_str());
-            return nullptr;
-          }
-        }
+  return true;
+}
 
-        p->lastAccessTime = chrono::steady_clock::now();
-        p->useCount++;
-        return p;
-      }
 
-    recursive_mutex tmp;
-    lock_guard<recursive_mutex> decompressionLock(recreatePartition ? recreatePartition->decompression_lock : tmp);
+static bool serialize_fs_index(const FileInfosMap & fs_file_infos, const vector<Fs8IndexSectionData> & sections,
+  vector<char> & bytes)
+{
+  string names;
+  vector<Fs8IndexBuilderEntry> entries;
+  entries.reserve(fs_file_infos.size());
+  for (auto & f : fs_file_infos)
+  {
+    string lowerCaseName = f.first;
+    normalize_file_name(lowerCaseName);
+
+    Fs8IndexBuilderEntry entry;
+    entry.nameOffset = uint32_t(names.length());
+    entry.nameLength = uint32_t(lowerCaseName.length());
+    entry.info = f.second;
+    entries.push_back(entry);
+    names += lowerCaseName;
+  }
+
+  return build_fs_index(names, entries, sections, bytes);
+}
 
 
-    FILE * f = FS_FOPEN(fs8_file_name_utf8, "rb");
-    if (!f)
-    {
-      Fs8FileSystem::errorLogCallback((string("Cannot open file ") + fs8_file_name_utf8).c_str());
-      return nullptr;
-    }
+// version 1 and 2 tables are converted to the version 3 layout when the archive is opened,
+// so there is only one (compact) in-memory representation of the file table
+static bool convert_legacy_file_table(const char * bytes, size_t size, int version, vector<char> & index_bytes)
+{
+  if (size < 4)
+    return false;
+  const char * cursor = bytes + 4; // skip size
+  int bytes_left = int(size) - 4;
 
-    char buf[24] = { 0 };
-    if (fread(buf, 24, 1, f) != 1)
-    {
-      Fs8FileSystem::errorLogCallback((string("Cannot read file ") + fs8_file_name_utf8).c_str());
-      fclose(f);
-      return nullptr;
-    }
+  string names;
+  names.reserve(size);
+  vector<Fs8IndexBuilderEntry> entries;
 
-    int64_t fileNamesOffset = check_header_get_file_names_offset(buf);
-    if (fileNamesOffset <= 0)
-    {
-      Fs8FileSystem::errorLogCallback((string("Not FS8 file ") + fs8_file_name_utf8).c_str());
-      fclose(f);
-      return nullptr;
-    }
+  uint16_t fileNameLength = 0;
 
-    if (FS_FSEEK(f, fileNamesOffset, SEEK_SET) != 0)
+  while (bytes_left > 0)
+  {
+    if (!read_bytes(&cursor, bytes_left, &fileNameLength, sizeof(fileNameLength)))
     {
-      Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
-      fclose(f);
-      return nullptr;
+      Fs8FileSystem::errorLogCallback("Corrupted file (cannot read fileNameLength)");
+      return false;
     }
 
-    uint32_t fnlen = 0;
-    if (FS_FSEEK(f, fileNamesOffset, SEEK_SET) != 0 || fread(&fnlen, sizeof(fnlen), 1, f) != 1 || fnlen > FS_MAX_FILENAMES_BINARY_SIZE)
+    if (fileNameLength > 512)
     {
-      Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
-      fclose(f);
-      return nullptr;
+      Fs8FileSystem::errorLogCallback("Corrupted file (fileNameLength > 512)");
+      return false;
     }
 
-    FS_FSEEK(f, -4, SEEK_CUR);
+    Fs8IndexBuilderEntry entry;
+    entry.nameOffset = uint32_t(names.length());
+    entry.nameLength = fileNameLength;
+    names.resize(names.length() + fileNameLength);
 
-    vector<char> fileNamesData;
-    fileNamesData.resize(fnlen + 4);
-    if (fread(&fileNamesData[0], fnlen + 4, 1, f) != 1)
+    if (!read_bytes(&cursor, bytes_left, &names[entry.nameOffset], fileNameLength))
     {
-      Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
-      fclose(f);
-      return nullptr;
+      Fs8FileSystem::errorLogCallback("Corrupted file (cannot read fileName)");
+      return false;
     }
 
-    Fs8Partition * partition = recreatePartition ? recreatePartition : new Fs8Partition;
-    partition->fileName = fname;
-    partition->isInMemory = false;
-    partition->fileDescriptor = f;
-    partition->useCount++;
+    Fs8FileInfo & fileInfo = entry.info;
 
-
-    if (!deserializeFileInfos(partition->fileInfos, fileNamesData))
+    if (!read_bytes(&cursor, bytes_left, &fileInfo, sizeof(int64_t) * 3))
     {
-      if (!recreatePartition)
-        delete partition;
-      Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
-      fclose(f);
-      return nullptr;
+      Fs8FileSystem::errorLogCallback("Corrupted file (cannot read fileInfo)");
+      return false;
     }
 
-    if (!recreatePartition)
+    if (version >= 2)
     {
-      if (partitions.empty())
-      {
-        partitions.reserve(FS_MAX_PARTITION);
-      }
-      partitions.push_back(partition);
+      fileInfo.flags = uint32_t(uint64_t(fileInfo.offsetInFile) >> FS_ENTRY_FLAGS_SHIFT);
+      fileInfo.offsetInFile &= FS_ENTRY_OFFSET_MASK;
     }
 
-    return partition;
-  }
-
-
-  Fs8Partition * findOrInitializePartitionMem(const void * mem, int64_t size = -1)
-  {
-    if (!mem)
+    if (fileInfo.isStored() && fileInfo.compressedSize != fileInfo.decompressedSize)
     {
-      Fs8FileSystem::errorLogCallback("Invalid pointer");
-      return nullptr;
+      Fs8FileSystem::errorLogCallback("Corrupted file (invalid size of stored file)");
+      return false;
     }
 
-    if (size < 24)
+    if ((fileInfo.flags & ~uint32_t(FS8_ENTRY_KNOWN_FLAGS)) != 0)
     {
-      Fs8FileSystem::errorLogCallback("Invalid partition size");
-      return nullptr;
+      Fs8FileSystem::errorLogCallback("Corrupted file (unknown entry flags)");
+      return false;
     }
 
-    lock_guard<recursive_mutex> lock(partitions_lock);
+    entries.push_back(entry);
+  }
 
-    for (Fs8Partition * p : partitions)
-      if (mem == p->inMemoryDataPtr)
-        return p;
+  return bytes_left == 0 && build_fs_index(names, entries, vector<Fs8IndexSectionData>(), index_bytes);
+}
 
-    int64_t fileNamesOffset = check_header_get_file_names_offset((const char *)mem);
-    if (fileNamesOffset <= 0 || fileNamesOffset >= size)
-    {
-      Fs8FileSystem::errorLogCallback("Not FS8 file");
-      return nullptr;
-    }
 
-    if (size > 0 && fileNamesOffset + 4 >= size)
-    {
-      Fs8FileSystem::errorLogCallback("Invalid file format");
-      return nullptr;
-    }
 
-    uint32_t fnlen = 0;
-    memcpy(&fnlen, (const char *)mem + fileNamesOffset, sizeof(fnlen));
+int64_t check_header_get_file_names_offset(const char buf[24], int * out_version = nullptr)
+{
+  if (strncmp(buf, "FS8.", 4) != 0)
+    return 0;
 
-    if (size > 0 && fileNamesOffset + 4 + fnlen > size)
-    {
-      Fs8FileSystem::errorLogCallback("Invalid file format");
-      return nullptr;
-    }
+  char version[] = "....";
+  memcpy(version, buf + 4, 4);
+  int v = atoi(version);
+  if (v < 1 || v > FS_FORMAT_VERSION)
+    return 0;
 
-    vector<char> fileNamesData((const char *)mem + fileNamesOffset, (const char *)mem + fileNamesOffset + fnlen + 4);
+  if (out_version)
+    *out_version = v;
 
-    Fs8Partition * partition = new Fs8Partition;
-    partition->isInMemory = true;
-    partition->fileDescriptor = nullptr;
-    partition->inMemorySize = size;
-    partition->inMemoryDataPtr = (const char *)mem;
+  int64_t fileNamesOffset = 0;
+  memcpy(&fileNamesOffset, buf + 8, sizeof(fileNamesOffset));
 
-    if (!deserializeFileInfos(partition->fileInfos, fileNamesData))
-    {
-      delete partition;
-      Fs8FileSystem::errorLogCallback("Invalid file format");
-      return nullptr;
-    }
+  return fileNamesOffset;
+}
 
-    if (partitions.empty())
-      partitions.reserve(FS_MAX_PARTITION);
-    partitions.push_back(partition);
-    return partition;
-  }
+int64_t check_header_get_sign_offset(const char buf[24])
+{
+  if (strncmp(buf, "FS8.", 4) != 0)
+    return 0;
 
+  int64_t signaturesOffset = 0;
+  memcpy(&signaturesOffset, buf + 8 + 8, sizeof(signaturesOffset));
 
-  void unusePartition(Fs8Partition * partition)
-  {
-    if (!partition || partition->isInMemory)
-      return;
+  return signaturesOffset;
+}
 
-    lock_guard<recursive_mutex> lock(partitions_lock);
 
-    partition->useCount--;
-    if (partition->useCount < 0)
-      Fs8FileSystem::errorLogCallback("Internal error (partition->useCount < 0)");
+static int64_t get_file_size(const string & file_name_utf8)
+{
+  error_code errCode;
+  uintmax_t size = filesystem::file_size(filesystem::path(string_to_wstring(file_name_utf8)), errCode);
+  return errCode ? 0 : int64_t(size);
+}
 
-    if (partition->useCount <= 0)
-    {
-      fclose(partition->fileDescriptor);
-      partition->fileDescriptor = nullptr;
-    }
-  }
 
-  static void checkPartionFileTime(Fs8Partition *& partition)
-  {
-    if (partition && partition->fileDescriptor)
-    {
-      auto elapsedTime = chrono::steady_clock::now() - partition->lastAccessTime;
-      int64_t msecAfterLastAccess = abs(chrono::duration_cast<chrono::milliseconds>(elapsedTime).count());
-      if (msecAfterLastAccess > FS_UNLOCK_FILE_AFTER_MS)
+const char * read_whole_file(const char * file_name_utf8, size_t & size)
+{
+  size = 0;
+  if (!file_name_utf8)
+    return nullptr;
+  FILE * f = FS_FOPEN(file_name_utf8, "rb");
+  if (!f)
+    return nullptr;
+
+  if (FS_FSEEK(f, 0, SEEK_END) != 0)
+  {
+    fclose(f);
+    return nullptr;
+  }
+
+  size = FS_FTELL(f);
+
+  if (FS_FSEEK(f, 0, SEEK_SET) != 0)
+  {
+    fclose(f);
+    size = 0;
+    return nullptr;
+  }
+
+  char * data = new char[size];
+  if (size > 0)
+    if (fread(data, size, 1, f) != 1)
+    {
+      delete[] data;
+      size = 0;
+      fclose(f);
+      return nullptr;
+    }
+
+  fclose(f);
+  return data;
+}
+
+
+static void fhash_block(uint32_t * block, int size_in_bytes, uint32_t & hash)
+{
+  uint32_t res = hash;
+  int size = size_in_bytes / sizeof(uint32_t);
+  for (int i = 0; i < size; i++)
+    res += block[i] + res * 33 + 1 + (res >> 6);
+  hash = res;
+}
+
+bool sign_file_fhash(const string & file_name_utf8)
+{
+  vector<char> data(65536 * 2);
+  FILE * f = FS_FOPEN(file_name_utf8.c_str(), "rb+");
+  if (!f)
+    return false;
+
+  uint32_t hash = 0;
+  size_t readBytes = 0;
+
+  while ((readBytes = fread(&data[0], 1, data.size(), f)) > 0)
+    fhash_block((uint32_t *)&data[0], int(readBytes), hash);
+
+  uint32_t signSize = 4 + 4 + 4;
+  uint32_t signType = 1;
+  fwrite(&signSize, 4, 1, f);
+  fwrite(&signType, 4, 1, f);
+  if (fwrite(&hash, 4, 1, f) != 1)
+  {
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+  return true;
+}
+
+// signature type 2
+struct Fs8ChunkedSignature
+{
+  uint32_t size;      // of the signature
+  uint32_t type;      // 2
+  uint32_t chunkSize;
+  uint32_t reserved;
+  uint64_t hash;
+};
+
+// XXH64 of every 'chunk_size' bytes of [0, size) (seeded with the chunk index), then XXH64 of these hashes,
+// the chunks are independent so they are hashed on all threads;
+// 'header' - if not null, hashed instead of the 24 byte header of the file
+static bool hash_file_chunks(FILE * f, int64_t size, int64_t chunk_size, int threads, uint64_t & out_hash,
+  const char * header = nullptr)
+{
+  int64_t chunkCount = (size + chunk_size - 1) / chunk_size;
+  vector<uint64_t> chunkHashes((size_t)chunkCount);
+  atomic<int64_t> nextChunk(0);
+  atomic<bool> failed(false);
+
+  auto hashChunks = [&]()
+  {
+    vector<char> buffer(size_t(min(chunk_size, size)));
+    for (int64_t i = nextChunk++; i < chunkCount && !failed; i = nextChunk++)
+    {
+      size_t length = size_t(min(chunk_size, size - i * chunk_size));
+      if (!FS_PREAD(f, &buffer[0], length, i * chunk_size))
+      {
+        failed = true;
+        break;
+      }
+      if (header && i == 0)
+        memcpy(&buffer[0], header, min(length, size_t(24)));
+      Fs8ContentHasher hasher((uint64_t)i);
+      hasher.update(&buffer[0], length);
+      chunkHashes[size_t(i)] = hasher.digest();
+    }
+  };
+
+  if (threads <= 0)
+    threads = max(int(thread::hardware_concurrency()), 1);
+  threads = int(max(min(int64_t(threads), chunkCount), int64_t(1)));
+
+  vector<thread> workers;
+  for (int i = 1; i < threads; i++)
+    workers.emplace_back(hashChunks);
+  hashChunks();
+  for (auto & w : workers)
+    w.join();
+
+  out_hash = hash_content(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t));
+  return !failed;
+}
+
+// writes the signature of [0, size) at 'size', 'header' is signed instead of the one in the file
+// (the file header is switched to it once the signature is on disk)
+static bool sign_file_chunked(FILE * f, int64_t size, const char * header, int threads)
+{
+  Fs8ChunkedSignature sign = {};
+  sign.size = sizeof(sign);
+  sign.type = 2;
+  sign.chunkSize = FS_SIGN_CHUNK_SIZE;
+  if (fflush(f) != 0 || !hash_file_chunks(f, size, sign.chunkSize, threads, sign.hash, header))
+    return false;
+
+  return FS_FSEEK(f, size, SEEK_SET) == 0 && fwrite(&sign, sizeof(sign), 1, f) == 1;
+}
+
+bool convert_file_to_hex32(const string & file_name_utf8)
+{
+  vector<char> data(65536);
+  FILE * f = FS_FOPEN(file_name_utf8.c_str(), "rb");
+  if (!f)
+    return false;
+
+  FILE * hexf = FS_FOPEN((file_name_utf8 + ".hex.tmp").c_str(), "wt");
+  if (!hexf)
+    return false;
+
+  uint32_t hash = 0;
+  size_t readBytes = 0;
+
+  while ((readBytes = fread(&data[0], 1, data.size(), f)) > 0)
+  {
+    readBytes = int(((readBytes - 1) | (sizeof(uint32_t) - 1)) + 1);
+    int cnt = int(readBytes / sizeof(uint32_t));
+    const uint32_t * p = (const uint32_t *)&data[0];
+    for (int i = 0; i < cnt; i++, p++)
+    {
+      fprintf(hexf, "0x%X,", *p);
+      if ((i & 15) == 15 || (*p & 0xFF) == '.')
+        fprintf(hexf, "\n");
+    }
+  }
+
+  fclose(hexf);
+  fclose(f);
+
+  return FS_RENAME((file_name_utf8 + ".hex.tmp").c_str(), file_name_utf8.c_str());
+}
+
+
+// Fs8Stats of a partition, every counter is also added to global_stats
+struct Fs8StatCounters
+{
+  atomic<int64_t> lookups = { 0 };
+  atomic<int64_t> lookupMisses = { 0 };
+  atomic<int64_t> cacheHits = { 0 };
+  atomic<int64_t> cacheMisses = { 0 };
+  atomic<int64_t> bytesRead = { 0 };
+  atomic<int64_t> bytesDecompressed = { 0 };
+  atomic<int64_t> decompressNsec = { 0 };
+  atomic<int64_t> cacheEvictions = { 0 };
+  atomic<int64_t> lockWaitNsec = { 0 };
+  atomic<int64_t> reopens = { 0 };
+  atomic<int64_t> reloads = { 0 };
+
+  Fs8Stats snapshot() const
+  {
+    Fs8Stats stats;
+    stats.lookups = lookups.load(memory_order_relaxed);
+    stats.lookupMisses = lookupMisses.load(memory_order_relaxed);
+    stats.cacheHits = cacheHits.load(memory_order_relaxed);
+    stats.cacheMisses = cacheMisses.load(memory_order_relaxed);
+    stats.bytesRead = bytesRead.load(memory_order_relaxed);
+    stats.bytesDecompressed = bytesDecompressed.load(memory_order_relaxed);
+    stats.decompressNsec = decompressNsec.load(memory_order_relaxed);
+    stats.cacheResidentBytes = 0;
+    stats.cacheEvictions = cacheEvictions.load(memory_order_relaxed);
+    stats.lockWaitNsec = lockWaitNsec.load(memory_order_relaxed);
+    stats.reopens = reopens.load(memory_order_relaxed);
+    stats.reloads = reloads.load(memory_order_relaxed);
+    return stats;
+  }
+
+  void reset()
+  {
+    for (atomic<int64_t> * counter : { &lookups, &lookupMisses, &cacheHits, &cacheMisses, &bytesRead, &bytesDecompressed,
+      &decompressNsec, &cacheEvictions, &lockWaitNsec, &reopens, &reloads })
+      counter->store(0, memory_order_relaxed);
+  }
+};
+
+static Fs8StatCounters global_stats;
+
+// 'stats' - counters of the partition, null if unknown (only the global counter is changed)
+static inline void add_stat(Fs8StatCounters * stats, atomic<int64_t> Fs8StatCounters::* counter, int64_t value)
+{
+  if (stats)
+    (stats->*counter).fetch_add(value, memory_order_relaxed);
+  (global_stats.*counter).fetch_add(value, memory_order_relaxed);
+}
+
+static inline int64_t nsec_since(chrono::steady_clock::time_point start)
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// lock_guard that counts the time spent waiting when the lock is held by another thread,
+// an uncontended lock costs no clock reads
+class Fs8TimedLock
+{
+  unique_lock<recursive_mutex> lock;
+
+public:
+  Fs8TimedLock(recursive_mutex & mutex_, Fs8StatCounters * stats) : lock(mutex_, try_to_lock)
+  {
+    if (lock.owns_lock())
+      return;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    lock.lock();
+    add_stat(stats, &Fs8StatCounters::lockWaitNsec, nsec_since(start));
+  }
+};
+
+
+// opened .fs8 file, readers keep a reference while they read so the file may be closed at any moment
+struct Fs8ArchiveFile
+{
+  FILE * fileDescriptor = nullptr;
+  const char * mappedDataPtr = nullptr; // whole file mapped read-only (memory mapped partitions only)
+  int64_t mappedSize = 0;
+  Fs8StatCounters * stats = nullptr;
+
+  Fs8ArchiveFile(FILE * f, bool memory_mapped, const string & file_name, Fs8StatCounters * stats_) :
+    fileDescriptor(f), stats(stats_)
+  {
+    if (memory_mapped)
+    {
+      mappedDataPtr = FS_MMAP(fileDescriptor, mappedSize);
+      if (!mappedDataPtr)
+        Fs8FileSystem::errorLogCallback((string("Cannot map file ") + file_name + ", falling back to pread").c_str());
+    }
+  }
+
+  ~Fs8ArchiveFile()
+  {
+    FS_MUNMAP(mappedDataPtr, mappedSize);
+    if (fileDescriptor)
+      fclose(fileDescriptor);
+  }
+
+  bool readAt(int64_t offset, void * buffer, size_t size)
+  {
+    add_stat(stats, &Fs8StatCounters::bytesRead, int64_t(size));
+    return FS_PREAD(fileDescriptor, buffer, size, offset);
+  }
+};
+
+
+using Fs8CachedBytes = shared_ptr<const vector<char>>;
+
+struct Fs8CacheEntry
+{
+  int64_t key = 0; // offsetInFile
+  uint64_t lastUse = 0;
+  Fs8CachedBytes bytes;
+};
+
+// decompressed small files of one file table
+struct Fs8TableCache
+{
+  list<Fs8CacheEntry> lru; // most recently used first
+  unordered_map<int64_t, list<Fs8CacheEntry>::iterator> entries;
+  int64_t residentBytes = 0;
+  int64_t maxBytes = -1; // -1 - Fs8CacheSettings::maxPartitionBytes
+  Fs8StatCounters * stats = nullptr; // counters of the partition that uses the table, set before it is published
+};
+
+
+// One budget for all partitions. Every table keeps its own LRU list, the global LRU victim is
+// the oldest tail of these lists (there are only a few tables, so the scan is cheap).
+// Cached bytes are refcounted, eviction never invalidates a copy that is being read.
+static class Fs8DecompressedCache
+{
+  mutex lock;
+  Fs8CacheSettings settings;
+  atomic<int64_t> keepInMemoryThreshold = { settings.keepInMemoryThreshold };
+  vector<Fs8TableCache *> tables;
+  int64_t totalBytes = 0;
+  uint64_t tick = 0;
+
+  static int64_t entryCost(const Fs8CacheEntry & entry)
+  {
+    return int64_t(entry.bytes->size()) + FS_CACHE_ENTRY_OVERHEAD;
+  }
+
+  int64_t tableLimit(const Fs8TableCache * table) const
+  {
+    int64_t limit = table->maxBytes >= 0 ? table->maxBytes : settings.maxPartitionBytes;
+    return limit > 0 ? limit : settings.maxTotalBytes;
+  }
+
+  void evictLast(Fs8TableCache * table, bool count_eviction = true)
+  {
+    Fs8CacheEntry & entry = table->lru.back();
+    int64_t cost = entryCost(entry);
+    table->residentBytes -= cost;
+    totalBytes -= cost;
+    table->entries.erase(entry.key);
+    table->lru.pop_back();
+    if (count_eviction)
+      add_stat(table->stats, &Fs8StatCounters::cacheEvictions, 1);
+  }
+
+  void evictOverBudget(Fs8TableCache * table)
+  {
+    if (table)
+      while (!table->lru.empty() && table->residentBytes > tableLimit(table))
+        evictLast(table);
+
+    while (totalBytes > settings.maxTotalBytes)
+    {
+      Fs8TableCache * victim = nullptr;
+      for (Fs8TableCache * t : tables)
+        if (!t->lru.empty() && (!victim || t->lru.back().lastUse < victim->lru.back().lastUse))
+          victim = t;
+      if (!victim)
+        break;
+      evictLast(victim);
+    }
+  }
+
+public:
+  bool isCacheable(int64_t size) const
+  {
+    return size < keepInMemoryThreshold.load(memory_order_relaxed);
+  }
+
+  bool isEnabled() const
+  {
+    return keepInMemoryThreshold.load(memory_order_relaxed) > 0;
+  }
+
+  void registerTable(Fs8TableCache * table)
+  {
+    lock_guard<mutex> guard(lock);
+    tables.push_back(table);
+  }
+
+  void unregisterTable(Fs8TableCache * table)
+  {
+    lock_guard<mutex> guard(lock);
+    totalBytes -= table->residentBytes;
+    table->residentBytes = 0;
+    table->entries.clear();
+    table->lru.clear();
+    tables.erase(remove(tables.begin(), tables.end(), table), tables.end());
+  }
+
+  // counts a cache hit or miss
+  Fs8CachedBytes find(Fs8TableCache * table, int64_t key)
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = table->entries.find(key);
+    if (it == table->entries.end())
+    {
+      add_stat(table->stats, &Fs8StatCounters::cacheMisses, 1);
+      return nullptr;
+    }
+    add_stat(table->stats, &Fs8StatCounters::cacheHits, 1);
+    it->second->lastUse = ++tick;
+    table->lru.splice(table->lru.begin(), table->lru, it->second);
+    return it->second->bytes;
+  }
+
+  bool contains(Fs8TableCache * table, int64_t key)
+  {
+    lock_guard<mutex> guard(lock);
+    return table->entries.find(key) != table->entries.end();
+  }
+
+  int64_t residentBytes(const Fs8TableCache * table) // null - all tables
+  {
+    lock_guard<mutex> guard(lock);
+    return table ? table->residentBytes : totalBytes;
+  }
+
+  void insert(Fs8TableCache * table, int64_t key, const Fs8CachedBytes & bytes)
+  {
+    lock_guard<mutex> guard(lock);
+    if (table->entries.find(key) != table->entries.end())
+      return;
+
+    Fs8CacheEntry entry;
+    entry.key = key;
+    entry.lastUse = ++tick;
+    entry.bytes = bytes;
+    int64_t cost = entryCost(entry);
+    if (cost > tableLimit(table) || cost > settings.maxTotalBytes)
+      return;
+
+    table->lru.push_front(entry);
+    table->entries[key] = table->lru.begin();
+    table->residentBytes += cost;
+    totalBytes += cost;
+    evictOverBudget(table);
+  }
+
+  void setTableStats(Fs8TableCache * table, Fs8StatCounters * stats)
+  {
+    lock_guard<mutex> guard(lock);
+    table->stats = stats;
+  }
+
+  void setTableLimit(Fs8TableCache * table, int64_t max_bytes)
+  {
+    lock_guard<mutex> guard(lock);
+    table->maxBytes = max_bytes;
+    evictOverBudget(table);
+  }
+
+  void setSettings(const Fs8CacheSettings & new_settings)
+  {
+    lock_guard<mutex> guard(lock);
+    settings = new_settings;
+    keepInMemoryThreshold.store(settings.keepInMemoryThreshold, memory_order_relaxed);
+    for (Fs8TableCache * t : tables)
+      evictOverBudget(t);
+    evictOverBudget(nullptr);
+  }
+
+  Fs8CacheSettings getSettings()
+  {
+    lock_guard<mutex> guard(lock);
+    return settings;
+  }
+
+  void clear()
+  {
+    lock_guard<mutex> guard(lock);
+    for (Fs8TableCache * t : tables)
+      while (!t->lru.empty())
+        evictLast(t, false);
+  }
+} decompressed_cache;
+
+
+// name being looked up, either as given by the caller or already normalized
+struct Fs8NameRef
+{
+  const char * name;
+  size_t length;
+  uint64_t hash;    // hash_file_name() of the normalized name
+  bool normalized;
+};
+
+static inline Fs8NameRef name_ref(std::string_view file_name)
+{
+  return Fs8NameRef{file_name.data(), file_name.length(), hash_file_name(file_name.data(), file_name.length(), true), false};
+}
+
+static inline Fs8NameRef name_ref(const Fs8FileName & file_name)
+{
+  const string & name = file_name.normalized();
+  return Fs8NameRef{name.c_str(), name.length(), file_name.hash(), true};
+}
+
+
+// file table of the opened archive, replaced as a whole when the archive is reloaded,
+// so cached bytes of the previous version are never served
+struct Fs8FileTable
+{
+  Fs8Index index;           // points into indexBytes or into the in-memory partition (version 3)
+  vector<char> indexBytes;
+  Fs8TableCache cache;
+
+  vector<ZSTD_DDict *> dictionaries; // digested once, shared by all readers
+
+  // verify-on-read: entries whose content hash has been checked, allocated when verification is first needed
+  unique_ptr<atomic<uint8_t>[]> verifiedEntries;
+  once_flag verifiedEntriesOnce;
+
+  Fs8FileTable(int64_t cache_limit)
+  {
+    cache.maxBytes = cache_limit;
+    decompressed_cache.registerTable(&cache);
+  }
+
+  ~Fs8FileTable()
+  {
+    decompressed_cache.unregisterTable(&cache);
+    for (ZSTD_DDict * ddict : dictionaries)
+      ZSTD_freeDDict(ddict);
+  }
+
+  // called once after index.init()
+  bool loadDictionaries()
+  {
+    const char * data = nullptr;
+    uint64_t size = 0;
+    if (!index.section(FS8_SECTION_DICTIONARIES, data, size))
+      return true;
+
+    uint32_t count = 0;
+    if (size < 8 || (memcpy(&count, data, 4), count > (size - 8) / 8))
+      return false;
+
+    uint64_t pos = align8(8 + uint64_t(count) * 8);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint64_t dictSize = load_at<uint64_t>(data, 8, i);
+      if (pos > size || dictSize > size - pos)
+        return false;
+      ZSTD_DDict * ddict = ZSTD_createDDict(data + pos, size_t(dictSize));
+      if (!ddict)
+        return false;
+      dictionaries.push_back(ddict);
+      pos = align8(pos + dictSize);
+    }
+    return true;
+  }
+
+  bool isVerified(int64_t entry)
+  {
+    call_once(verifiedEntriesOnce, [this]() { verifiedEntries.reset(new atomic<uint8_t>[index.size()]()); });
+    return verifiedEntries[size_t(entry)].load(memory_order_acquire) != 0;
+  }
+
+  void setVerified(int64_t entry)
+  {
+    verifiedEntries[size_t(entry)].store(1, memory_order_release);
+  }
+
+  const ZSTD_DDict * findDictionary(unsigned dict_id) const
+  {
+    for (size_t i = 0; dict_id != 0 && i < dictionaries.size(); i++)
+      if (ZSTD_getDictID_fromDDict(dictionaries[i]) == dict_id)
+        return dictionaries[i];
+    return nullptr;
+  }
+
+  // 'name' must be normalized
+  bool find(const string & name, Fs8FileInfo & out_info) const
+  {
+    return find(Fs8NameRef{name.c_str(), name.length(), hash_file_name(name.c_str(), name.length()), true}, out_info);
+  }
+
+  bool find(const Fs8NameRef & name, Fs8FileInfo & out_info) const
+  {
+    int64_t entry = index.find(name.name, name.length, name.hash, name.normalized);
+    if (cache.stats) // tables read by the packer are not counted
+    {
+      add_stat(cache.stats, &Fs8StatCounters::lookups, 1);
+      if (entry < 0)
+        add_stat(cache.stats, &Fs8StatCounters::lookupMisses, 1);
+    }
+    if (entry < 0)
+      return false;
+    if (!index.entryInfo(size_t(entry), out_info))
+    {
+      Fs8FileSystem::errorLogCallback("Corrupted file (unknown entry flags)");
+      return false;
+    }
+    return true;
+  }
+
+  void getAllFileNamesInArchiveOrder(vector<string> & out_file_names) const
+  {
+    vector<pair<pair<int64_t, int64_t>, size_t>> order; // (offsetInFile, offsetInBlock), entry
+    order.reserve(index.size());
+    for (size_t i = 0; i < index.size(); i++)
+    {
+      Fs8FileInfo info;
+      index.entryInfo(i, info);
+      order.push_back(make_pair(make_pair(info.offsetInFile, info.offsetInBlock), i));
+    }
+    sort(order.begin(), order.end());
+
+    out_file_names.reserve(out_file_names.size() + order.size());
+    for (auto & o : order)
+    {
+      const char * name = nullptr;
+      size_t length = 0;
+      if (index.entryName(o.second, name, length))
+        out_file_names.push_back(string(name, length));
+    }
+  }
+
+  void getAllFileNames(vector<string> & out_file_names) const
+  {
+    out_file_names.reserve(out_file_names.size() + index.size());
+    for (size_t i = 0; i < index.size(); i++)
+    {
+      const char * name = nullptr;
+      size_t length = 0;
+      if (index.entryName(i, name, length))
+        out_file_names.push_back(string(name, length));
+    }
+  }
+};
+
+
+// frames compressed with a dictionary carry its ID in the frame header
+static size_t decompress_frames(const Fs8FileTable * table, void * dst, size_t dst_size, const void * src, size_t src_size)
+{
+  const ZSTD_DDict * ddict = table ? table->findDictionary(ZSTD_getDictID_fromFrame(src, src_size)) : nullptr;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  size_t res = ZSTD_decompress_usingDDict(zstd_decompress_context.get(), dst, dst_size, src, src_size, ddict);
+  Fs8StatCounters * stats = table ? table->cache.stats : nullptr;
+  add_stat(stats, &Fs8StatCounters::decompressNsec, nsec_since(start));
+  if (!ZSTD_isError(res))
+    add_stat(stats, &Fs8StatCounters::bytesDecompressed, int64_t(res));
+  return res;
+}
+
+
+// reads the file table of an opened archive (any version), errors are logged
+static shared_ptr<Fs8FileTable> read_file_table(FILE * f, const char * fs8_file_name_utf8, int64_t cache_limit)
+{
+  char buf[24] = { 0 };
+  if (fread(buf, 24, 1, f) != 1)
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot read file ") + fs8_file_name_utf8).c_str());
+    return nullptr;
+  }
+
+  int version = 0;
+  int64_t fileNamesOffset = check_header_get_file_names_offset(buf, &version);
+  if (fileNamesOffset <= 0)
+  {
+    Fs8FileSystem::errorLogCallback((string("Not FS8 file ") + fs8_file_name_utf8).c_str());
+    return nullptr;
+  }
+
+  if (FS_FSEEK(f, fileNamesOffset, SEEK_SET) != 0)
+  {
+    Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
+    return nullptr;
+  }
+
+  // version 1, 2: uint32 size of the table - 4,  version 3: Fs8IndexHeader
+  uint64_t tableSize = 0;
+  Fs8IndexHeader indexHeader;
+  if (version >= 3)
+  {
+    if (fread(&indexHeader, sizeof(indexHeader), 1, f) == 1)
+      tableSize = indexHeader.tableSize;
+  }
+  else
+  {
+    uint32_t fnlen = 0;
+    if (fread(&fnlen, sizeof(fnlen), 1, f) == 1)
+      tableSize = uint64_t(fnlen) + 4;
+  }
+
+  if (tableSize < 4 || tableSize > FS_MAX_FILENAMES_BINARY_SIZE)
+  {
+    Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
+    return nullptr;
+  }
+
+  vector<char> fileNamesData;
+  fileNamesData.resize(size_t(tableSize));
+  if (!FS_PREAD(f, &fileNamesData[0], fileNamesData.size(), fileNamesOffset))
+  {
+    Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
+    return nullptr;
+  }
+
+  shared_ptr<Fs8FileTable> table = make_shared<Fs8FileTable>(cache_limit);
+  if (version >= 3)
+    table->indexBytes.swap(fileNamesData);
+  else if (!convert_legacy_file_table(&fileNamesData[0], fileNamesData.size(), version, table->indexBytes))
+    table->indexBytes.clear();
+
+  if (table->indexBytes.empty() || !table->index.init(&table->indexBytes[0], table->indexBytes.size()) ||
+    !table->loadDictionaries())
+  {
+    Fs8FileSystem::errorLogCallback((string("Corrupted file ") + fs8_file_name_utf8).c_str());
+    return nullptr;
+  }
+
+  return table;
+}
+
+
+// what readers need of an opened archive, replaced as a whole and never changed after it is published
+struct Fs8PartitionState
+{
+  shared_ptr<Fs8FileTable> fileTable;
+  shared_ptr<Fs8ArchiveFile> archiveFile; // null when the file is closed (and always for in-memory partitions)
+};
+
+
+// Epoch-based reclamation of replaced partition states and overlay indexes. While a thread uses them it announces
+// the epoch it started in, an object replaced in epoch E is deleted once no thread announces E or earlier.
+// Readers only store to their own slot, nothing shared is written or locked on the read path.
+static struct Fs8StateEpochs
+{
+  struct alignas(64) Slot
+  {
+    atomic<uint64_t> epoch = { 0 }; // 0 - the thread uses no state
+    int depth = 0;                  // nested pins of the owning thread
+  };
+
+  struct Retired
+  {
+    uint64_t epoch;
+    const void * object;
+    void (*destroy)(const void *);
+  };
+
+  atomic<uint64_t> epoch = { 1 };
+  mutex lock; // guards 'slots' and 'retired'
+  vector<Slot *> slots;
+  vector<Retired> retired;
+
+  ~Fs8StateEpochs()
+  {
+    for (auto & r : retired)
+      r.destroy(r.object);
+  }
+
+  Slot * registerThread()
+  {
+    lock_guard<mutex> guard(lock);
+    slots.push_back(new Slot);
+    return slots.back();
+  }
+
+  void unregisterThread(Slot * slot)
+  {
+    {
+      lock_guard<mutex> guard(lock);
+      slots.erase(find(slots.begin(), slots.end(), slot));
+    }
+    delete slot;
+  }
+
+  // 'object' is no longer published
+  template <typename T>
+  void retire(const T * object)
+  {
+    if (!object)
+      return;
+    uint64_t retiredIn = epoch.fetch_add(1);
+    {
+      lock_guard<mutex> guard(lock);
+      retired.push_back(Retired{ retiredIn, object, [](const void * p) { delete (const T *)p; } });
+    }
+    reclaim();
+  }
+
+  // objects are deleted outside the lock, destructors of states close files and unregister caches
+  void reclaim()
+  {
+    vector<Retired> unused;
+    {
+      lock_guard<mutex> guard(lock);
+      if (retired.empty())
+        return;
+
+      uint64_t oldest = UINT64_MAX;
+      for (Slot * slot : slots)
+      {
+        uint64_t e = slot->epoch.load();
+        if (e != 0)
+          oldest = min(oldest, e);
+      }
+
+      size_t kept = 0;
+      for (auto & r : retired)
+        if (r.epoch < oldest)
+          unused.push_back(r);
+        else
+          retired[kept++] = r;
+      retired.resize(kept);
+    }
+
+    for (auto & r : unused)
+      r.destroy(r.object);
+  }
+} state_epochs;
+
+struct Fs8EpochSlotHolder
+{
+  Fs8StateEpochs::Slot * slot = state_epochs.registerThread();
+  ~Fs8EpochSlotHolder() { state_epochs.unregisterThread(slot); }
+};
+
+static Fs8StateEpochs::Slot & this_thread_epoch_slot()
+{
+  static thread_local Fs8EpochSlotHolder holder;
+  return *holder.slot;
+}
+
+// everything published (partition states, overlay indexes) and loaded while the guard exists stays alive
+struct Fs8EpochGuard
+{
+  Fs8EpochGuard()
+  {
+    Fs8StateEpochs::Slot & slot = this_thread_epoch_slot();
+    if (slot.depth++ == 0)
+      slot.epoch.store(state_epochs.epoch.load());
+  }
+
+  ~Fs8EpochGuard()
+  {
+    Fs8StateEpochs::Slot & slot = this_thread_epoch_slot();
+    if (--slot.depth == 0)
+      slot.epoch.store(0, memory_order_release);
+  }
+
+  Fs8EpochGuard(const Fs8EpochGuard &) = delete;
+  Fs8EpochGuard & operator=(const Fs8EpochGuard &) = delete;
+};
+
+// the published state stays alive while the pin exists
+struct Fs8PinnedState
+{
+  Fs8EpochGuard guard;
+  const Fs8PartitionState * state = nullptr;
+
+  explicit Fs8PinnedState(const atomic<const Fs8PartitionState *> & published) :
+    state(published.load())
+  {
+  }
+
+  const Fs8PartitionState * operator->() const { return state; }
+};
+
+
+struct Fs8Partition
+{
+  bool isInMemory = false;
+  atomic<bool> isMemoryMapped = { false };
+  string fileName; // not changed after the partition is published
+  uint64_t fileTime = 0;
+  atomic<int64_t> lastAccessTime = { 0 }; // steady_clock ticks
+
+  const char * inMemoryDataPtr = nullptr;
+  int64_t inMemorySize = 0;
+  atomic<int> useCount = { 0 }; // changed under partitions_lock, except for the lock-free reuse in PartitionsContainer::tryReusePartition()
+  int64_t cacheLimit = -1; // -1 - Fs8CacheSettings::maxPartitionBytes
+  atomic<bool> verifyOnRead = { false };
+  Fs8StatCounters stats;
+
+  // Readers pin the state (Fs8PinnedState) and never lock. decompression_lock serializes the writers
+  // (open, reload, close), it is never held while reading or decompressing.
+  atomic<const Fs8PartitionState *> state = { new Fs8PartitionState };
+  recursive_mutex decompression_lock;
+
+  ~Fs8Partition()
+  {
+    delete state.load();
+  }
+
+  void touch()
+  {
+    lastAccessTime.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+  }
+
+  int64_t msecAfterLastAccess() const
+  {
+    chrono::steady_clock::duration elapsed = chrono::steady_clock::now().time_since_epoch() -
+      chrono::steady_clock::duration(lastAccessTime.load(memory_order_relaxed));
+    return abs(chrono::duration_cast<chrono::milliseconds>(elapsed).count());
+  }
+
+  // lookups and reads use the pinned state directly, copies are taken only by those that keep them
+  Fs8PinnedState pinState() const
+  {
+    return Fs8PinnedState(state);
+  }
+
+  void getState(shared_ptr<Fs8FileTable> & table, shared_ptr<Fs8ArchiveFile> & file) const
+  {
+    Fs8PinnedState current(state);
+    table = current->fileTable;
+    file = current->archiveFile;
+  }
+
+  shared_ptr<Fs8FileTable> getFileTable() const
+  {
+    Fs8PinnedState current(state);
+    return current->fileTable;
+  }
+
+  bool isFileOpen() const
+  {
+    Fs8PinnedState current(state);
+    return current->archiveFile != nullptr;
+  }
+
+  // publishes a new state, null 'table' keeps the current one
+  void setState(const shared_ptr<Fs8FileTable> & table, const shared_ptr<Fs8ArchiveFile> & file)
+  {
+    Fs8TimedLock lock(decompression_lock, &stats);
+    Fs8PartitionState * next = new Fs8PartitionState;
+    next->fileTable = table ? table : state.load()->fileTable;
+    next->archiveFile = file;
+    state_epochs.retire(state.exchange(next));
+  }
+
+  // readers that already hold the file finish their reads, the file is closed by the last of them
+  void closeFile()
+  {
+    setState(nullptr, nullptr);
+  }
+};
+
+
+
+static struct PartitionsContainer
+{
+  vector<Fs8Partition *> partitions; // guarded by partitions_lock
+  atomic<const vector<Fs8Partition *> *> published = { nullptr }; // copy of 'partitions' for lock-free readers
+  vector<unique_ptr<const vector<Fs8Partition *>>> publishedLists; // every published copy, kept until exit
+
+  // called under partitions_lock after 'partitions' is changed, partitions are never deleted before exit
+  // (and neither are the published copies, there is one per partition)
+  void publish()
+  {
+    publishedLists.emplace_back(new vector<Fs8Partition *>(partitions));
+    published.store(publishedLists.back().get(), memory_order_release);
+  }
+
+  // An archive opened by another Fs8FileSystem is reused without partitions_lock. The use count is taken
+  // only while it is above zero, i.e. while the file cannot be closed as unused, anything else goes the locked way.
+  Fs8Partition * tryReusePartition(const string & fs8_file_name_utf8, bool memory_mapped)
+  {
+    const vector<Fs8Partition *> * list = published.load(memory_order_acquire);
+    if (!list)
+      return nullptr;
+
+    for (Fs8Partition * p : *list)
+      if (!p->isInMemory && p->fileName == fs8_file_name_utf8)
+      {
+        if (memory_mapped && !p->isMemoryMapped)
+          return nullptr;
+
+        int count = p->useCount.load();
+        while (count > 0)
+          if (p->useCount.compare_exchange_weak(count, count + 1))
+          {
+            if (p->isFileOpen())
+            {
+              p->touch();
+              return p;
+            }
+            unusePartition(p); // closed by act(), the file has changed
+            return nullptr;
+          }
+        return nullptr;
+      }
+
+    return nullptr;
+  }
+
+  ~PartitionsContainer()
+  {
+    lock_guard<recursive_mutex> lock(partitions_lock);
+
+    for (auto & p : partitions)
+    {
+      delete p;
+      p = nullptr;
+    }
+    partitions.clear();
+    published.store(nullptr);
+  }
+
+
+  // will increment use counter
+  Fs8Partition * findOrInitializePartitionFn(const char * fs8_file_name_utf8, bool memory_mapped)
+  {
+    if (!fs8_file_name_utf8 || !fs8_file_name_utf8[0])
+    {
+      Fs8FileSystem::errorLogCallback("Empty file name");
+      return nullptr;
+    }
+
+    lock_guard<recursive_mutex> lock(partitions_lock);
+
+    Fs8Partition * recreatePartition = nullptr;
+
+    string fname = fs8_file_name_utf8;
+    for (Fs8Partition * p : partitions)
+      if (fname == p->fileName)
+      {
+        bool remap = memory_mapped && !p->isMemoryMapped;
+        if (!p->isFileOpen() || remap)
+        {
+          uint64_t curFileTime = get_file_time(fs8_file_name_utf8);
+          if (p->fileTime != curFileTime)
+          {
+            recreatePartition = p;
+            break;
+          }
+
+          FILE * f = FS_FOPEN(fs8_file_name_utf8, "rb");
+          if (!f)
+          {
+            Fs8FileSystem::errorLogCallback((string("Cannot open file ") + fs8_file_name_utf8).c_str());
+            return nullptr;
+          }
+
+          p->isMemoryMapped = p->isMemoryMapped || memory_mapped;
+          add_stat(&p->stats, &Fs8StatCounters::reopens, 1);
+          p->setState(nullptr, make_shared<Fs8ArchiveFile>(f, p->isMemoryMapped, fname, &p->stats));
+        }
+
+        p->touch();
+        p->useCount++;
+        return p;
+      }
+
+
+    FILE * f = FS_FOPEN(fs8_file_name_utf8, "rb");
+    if (!f)
+    {
+      Fs8FileSystem::errorLogCallback((string("Cannot open file ") + fs8_file_name_utf8).c_str());
+      return nullptr;
+    }
+
+    shared_ptr<Fs8FileTable> table = read_file_table(f, fs8_file_name_utf8, recreatePartition ? recreatePartition->cacheLimit : -1);
+    if (!table)
+    {
+      fclose(f);
+      return nullptr;
+    }
+
+    Fs8Partition * partition = recreatePartition ? recreatePartition : new Fs8Partition;
+    decompressed_cache.setTableStats(&table->cache, &partition->stats);
+    if (!recreatePartition)
+      partition->fileName = fname;
+    partition->isMemoryMapped = partition->isMemoryMapped || memory_mapped;
+    partition->fileTime = get_file_time(fs8_file_name_utf8);
+    partition->useCount++;
+    partition->touch();
+
+    partition->setState(table, make_shared<Fs8ArchiveFile>(f, partition->isMemoryMapped, fname, &partition->stats));
+    if (recreatePartition)
+    {
+      file_tables_generation++;
+      add_stat(&partition->stats, &Fs8StatCounters::reopens, 1);
+      add_stat(&partition->stats, &Fs8StatCounters::reloads, 1);
+    }
+
+    if (!recreatePartition)
+    {
+      if (partitions.empty())
+      {
+        partitions.reserve(FS_MAX_PARTITION);
+      }
+      partitions.push_back(partition);
+      publish();
+    }
+
+    return partition;
+  }
+
+
+  Fs8Partition * findOrInitializePartitionMem(const void * mem, int64_t size = -1)
+  {
+    if (!mem)
+    {
+      Fs8FileSystem::errorLogCallback("Invalid pointer");
+      return nullptr;
+    }
+
+    if (size < 24)
+    {
+      Fs8FileSystem::errorLogCallback("Invalid partition size");
+      return nullptr;
+    }
+
+    lock_guard<recursive_mutex> lock(partitions_lock);
+
+    for (Fs8Partition * p : partitions)
+      if (mem == p->inMemoryDataPtr)
+        return p;
+
+    int version = 0;
+    int64_t fileNamesOffset = check_header_get_file_names_offset((const char *)mem, &version);
+    if (fileNamesOffset <= 0 || fileNamesOffset >= size)
+    {
+      Fs8FileSystem::errorLogCallback("Not FS8 file");
+      return nullptr;
+    }
+
+    if (size > 0 && fileNamesOffset + 4 >= size)
+    {
+      Fs8FileSystem::errorLogCallback("Invalid file format");
+      return nullptr;
+    }
+
+    shared_ptr<Fs8FileTable> table = make_shared<Fs8FileTable>(-1);
+
+    if (version >= 3)
+    {
+      // the table is used in place
+      if (!table->index.init((const char *)mem + fileNamesOffset, uint64_t(size - fileNamesOffset)) ||
+        !table->loadDictionaries())
+      {
+        Fs8FileSystem::errorLogCallback("Invalid file format");
+        return nullptr;
+      }
+    }
+    else
+    {
+      uint32_t fnlen = 0;
+      memcpy(&fnlen, (const char *)mem + fileNamesOffset, sizeof(fnlen));
+
+      if (size > 0 && fileNamesOffset + 4 + fnlen > size)
+      {
+        Fs8FileSystem::errorLogCallback("Invalid file format");
+        return nullptr;
+      }
+
+      if (!convert_legacy_file_table((const char *)mem + fileNamesOffset, size_t(fnlen) + 4, version, table->indexBytes) ||
+        !table->index.init(&table->indexBytes[0], table->indexBytes.size()))
+      {
+        Fs8FileSystem::errorLogCallback("Invalid file format");
+        return nullptr;
+      }
+    }
+
+    Fs8Partition * partition = new Fs8Partition;
+    decompressed_cache.setTableStats(&table->cache, &partition->stats);
+    partition->isInMemory = true;
+    partition->inMemorySize = size;
+    partition->inMemoryDataPtr = (const char *)mem;
+    partition->setState(table, nullptr);
+
+    if (partitions.empty())
+      partitions.reserve(FS_MAX_PARTITION);
+    partitions.push_back(partition);
+    publish();
+    return partition;
+  }
+
+
+  void unusePartition(Fs8Partition * partition)
+  {
+    if (!partition || partition->isInMemory)
+      return;
+
+    Fs8TimedLock lock(partitions_lock, &partition->stats);
+
+    partition->useCount--;
+    if (partition->useCount < 0)
+      Fs8FileSystem::errorLogCallback("Internal error (partition->useCount < 0)");
+
+    if (partition->useCount <= 0)
+      partition->closeFile();
+  }
+
+  // the file time is read without the lock, partitions_lock is taken only to close a changed file
+  static void checkPartionFileTime(Fs8Partition * partition)
+  {
+    if (partition && !partition->isInMemory && partition->isFileOpen())
+    {
+      if (partition->msecAfterLastAccess() > FS_UNLOCK_FILE_AFTER_MS)
+      {
+        uint64_t curFileTime = get_file_time(partition->fileName.c_str());
+        Fs8TimedLock lock(partitions_lock, &partition->stats);
+        if (partition->fileTime != curFileTime && partition->isFileOpen())
+          partition->closeFile();
+      }
+    }
+  }
+
+
+  atomic<int64_t> lastActTime = { 0 }; // steady_clock ticks
+
+  // one thread per 100 msec checks the partitions, concurrent calls return at once
+  void act()
+  {
+    int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+    int64_t last = lastActTime.load(memory_order_relaxed);
+    chrono::steady_clock::duration elapsed = chrono::steady_clock::duration(now - last);
+    if (abs(chrono::duration_cast<chrono::milliseconds>(elapsed).count()) <= 100 ||
+      !lastActTime.compare_exchange_strong(last, now, memory_order_relaxed))
+      return;
+
+    const vector<Fs8Partition *> * list = published.load(memory_order_acquire);
+    if (list)
+      for (Fs8Partition * p : *list)
+        checkPartionFileTime(p);
+
+    state_epochs.reclaim(); // states replaced while they were in use
+  }
+
+} file_systems_container;
+
+
+void Fs8FileSystem::act()
+{
+  file_systems_container.act();
+}
+
+
+Fs8FileSystem::Fs8FileSystem()
+{
+}
+
+static bool check_signatures(const string & fs8_file_name_utf8, int threads)
+{
+  vector<char> data(65536 * 2);
+  FILE * f = FS_FOPEN(fs8_file_name_utf8.c_str(), "rb");
+  if (!f)
+    return false;
+
+  if (fread(&data[0], 32, 1, f) != 1)
+  {
+    fclose(f);
+    return false;
+  }
+
+  int64_t pos = check_header_get_sign_offset(&data[0]);
+
+  if (pos <= 0)
+  {
+    fclose(f);
+    return false;
+  }
+
+  FS_FSEEK(f, pos, SEEK_SET);
+  struct
+  {
+    uint32_t size;
+    uint32_t type;
+    uint32_t hash;
+  } s;
+
+  if (fread(&s, 8, 1, f) != 1)
+  {
+    fclose(f);
+    return false;
+  }
+
+  if (s.type == 1 && fread(&s.hash, sizeof(s.hash), 1, f) == 1)
+  {
+    FS_FSEEK(f, 0, SEEK_SET);
+    size_t readBytes = 0;
+    uint32_t hash = 0;
+    int64_t p = pos;
+    while (p > 0 && (readBytes = fread(&data[0], 1, size_t(min(int64_t(data.size()), p)), f)) > 0)
+    {
+      fhash_block((uint32_t *)&data[0], int(readBytes), hash);
+      p -= int64_t(readBytes);
+    }
+
+    fclose(f);
+    return hash == s.hash;
+  }
+
+  Fs8ChunkedSignature sign;
+  if (s.type == 2 && s.size == sizeof(sign) && FS_PREAD(f, &sign, sizeof(sign), pos) && sign.chunkSize > 0)
+  {
+    uint64_t hash = 0;
+    bool valid = hash_file_chunks(f, pos, sign.chunkSize, threads, hash) && hash == sign.hash;
+    fclose(f);
+    return valid;
+  }
+
+  fclose(f);
+  return false;
+}
+
+
+struct Fs8SignatureCheck
+{
+  int64_t fileSize = 0;
+  uint64_t fileTime = 0;
+  bool valid = false;
+};
+
+static mutex signature_checks_lock;
+static unordered_map<string, Fs8SignatureCheck> signature_checks;
+
+// an archive is not hashed again until its size or modification time changes
+bool Fs8FileSystem::checkFs8FileSystemSignatures(const char * fs8_file_name_utf8, int threads)
+{
+  if (!fs8_file_name_utf8)
+    return false;
+
+  string fullName = get_absolute_file_name(fs8_file_name_utf8);
+  Fs8SignatureCheck check;
+  check.fileSize = get_file_size(fullName);
+  check.fileTime = get_file_time(fullName.c_str());
+
+  {
+    lock_guard<mutex> guard(signature_checks_lock);
+    auto it = signature_checks.find(fullName);
+    if (it != signature_checks.end() && it->second.fileSize == check.fileSize && it->second.fileTime == check.fileTime)
+      return it->second.valid;
+  }
+
+  check.valid = check_signatures(fullName, threads);
+
+  lock_guard<mutex> guard(signature_checks_lock);
+  signature_checks[fullName] = check;
+  return check.valid;
+}
+
+
+bool Fs8FileSystem::createFs8FromFiles(const char * dir_, const vector<string> & file_names,
+  const char * out_file_name_utf8_, int compression_level, bool write_as_hex32, vector<string> * ignore_list, int threads)
+{
+  vector<pair<string, string>> namePairs;
+  for (const auto & n : file_names)
+    namePairs.emplace_back(make_pair(n, string()));
+  return createFs8FromFiles(dir_, namePairs, out_file_name_utf8_, compression_level, write_as_hex32, ignore_list, threads);
+}
+
+bool Fs8FileSystem::createFs8FromFiles(const char * dir_, const vector<pair<string, string>> & file_names,
+  const char * out_file_name_utf8_, int compression_level, bool write_as_hex32, vector<string> * ignore_list, int threads)
+{
+  Fs8PackOptions options;
+  options.compressionLevel = compression_level;
+  options.writeAsHex32 = write_as_hex32;
+  options.threads = threads;
+  return createFs8FromFiles(dir_, file_names, out_file_name_utf8_, options, ignore_list);
+}
+
+static bool recurseve_find_files(string dir, vector<string> & res)
+{
+  if (!dir.empty() && dir.back() != '\\' && dir.back() != '/')
+    dir += "/";
+
+  error_code errCode;
+  for (filesystem::recursive_directory_iterator dirEntry(string_to_wstring(dir), errCode), end; dirEntry != end; ++dirEntry)
+    if (dirEntry->is_regular_file())
+    {
+      string s = wstring_to_string(dirEntry->path().generic_wstring());
+      if (s.length() > dir.length())
+        res.push_back(string(s.c_str() + dir.length()));
+    }
+
+  if (errCode.value() != 0)
+    Fs8FileSystem::errorLogCallback(errCode.message().c_str());
+
+  return errCode.value() == 0;
+}
+
+static bool expand_file_masks(string dir, vector<pair<string, string>> & file_names)
+{
+  if (!dir.empty() && (dir.back() != '\\' && dir.back() != '/'))
+    dir += "/";
+
+  for (int i = (file_names.size()) - 1; i >= 0; i--)
+  {
+    pair<string, string> namePair = file_names[i];
+    string name = namePair.first;
+    string archiveName = namePair.second;
+    if (!name.empty() && name.back() == '*')
+    {
+      name.pop_back();
+      if (!archiveName.empty() && archiveName.back() != '*')
+      {
+        Fs8FileSystem::errorLogCallback((string("Expected '*' at end of in-archive file name ") + archiveName).c_str());
+        return false;
+      }
+      if (!archiveName.empty() && archiveName.back() == '*')
+        archiveName.pop_back();
+      file_names.erase(file_names.begin() + i);
+
+      vector<string> found;
+      if (!recurseve_find_files(dir + name, found))
+      {
+        Fs8FileSystem::errorLogCallback("recurseve_find_files() failed");
+        return false;
+      }
+
+      if (archiveName.empty())
+        archiveName = name;
+
+      if (archiveName == "/" || archiveName == "./")
+        archiveName = "";
+
+      for (auto & f : found)
+        file_names.push_back(make_pair(dir + name + f, archiveName + f));
+    }
+  }
+
+  return true;
+}
+
+
+struct PackJob
+{
+  string fullName;
+  string archiveName;
+  const ZSTD_CDict * dictionary = nullptr;
+  vector<PackJob> blockFiles; // solid block: files packed together into one frame, fullName and archiveName are empty
+};
+
+static int64_t get_job_size(const PackJob & job)
+{
+  if (job.blockFiles.empty())
+    return get_file_size(job.fullName);
+  int64_t size = 0;
+  for (auto & f : job.blockFiles)
+    size += get_file_size(f.fullName);
+  return size;
+}
+
+struct PackedBlob
+{
+  vector<char> compressedData;
+  size_t compressedSize = 0;
+  size_t fileSize = 0;
+  uint32_t flags = 0;
+  int64_t reservedBytes = 0;
+  bool done = false;
+  bool ok = false;
+  bool streamed = false; // too large to keep in memory, the writer compresses it with pack_file_stream()
+  uint64_t contentHash = 0;
+  bool duplicate = false; // an earlier job has the same content, nothing was compressed
+  vector<int64_t> blockFileSizes; // solid block: sizes of PackJob::blockFiles, the files follow each other
+  vector<uint64_t> blockFileHashes;
+};
+
+static bool files_equal(const string & a, const string & b)
+{
+  FILE * fa = FS_FOPEN(a.c_str(), "rb");
+  FILE * fb = fa ? FS_FOPEN(b.c_str(), "rb") : nullptr;
+  bool equal = fa && fb;
+  vector<char> bufA(equal ? 1 << 20 : 0), bufB(bufA.size());
+  while (equal)
+  {
+    size_t readA = fread(&bufA[0], 1, bufA.size(), fa);
+    size_t readB = fread(&bufB[0], 1, bufB.size(), fb);
+    equal = readA == readB && memcmp(&bufA[0], &bufB[0], readA) == 0 && !ferror(fa) && !ferror(fb);
+    if (readA == 0)
+      break;
+  }
+  if (fa)
+    fclose(fa);
+  if (fb)
+    fclose(fb);
+  return equal;
+}
+
+
+// Whether the entry of the archive 'f' has the bytes of the file 'full_name'. The entry is read with FS_PREAD
+// and decompressed piece by piece (a solid block at once), so memory use does not depend on the file size.
+static bool entry_equals_file(FILE * f, const Fs8FileTable * table, const Fs8FileInfo & info, const string & full_name)
+{
+  if (info.decompressedSize < 0 || info.compressedSize < 0 || info.offsetInFile < 24)
+    return false;
+
+  FILE * src = FS_FOPEN(full_name.c_str(), "rb");
+  if (!src)
+    return false;
+
+  vector<char> fileBuf;
+  auto equalsNext = [&](const char * data, size_t size)
+  {
+    fileBuf.resize(max(fileBuf.size(), size));
+    return size == 0 || (fread(&fileBuf[0], size, 1, src) == 1 && memcmp(&fileBuf[0], data, size) == 0);
+  };
+
+  bool equal = true;
+  vector<char> compressed;
+  if (info.isInBlock())
+  {
+    compressed.resize(size_t(max(info.compressedSize, int64_t(1))));
+    unsigned long long blockSize = 0;
+    equal = FS_PREAD(f, &compressed[0], size_t(info.compressedSize), info.offsetInFile) &&
+      (blockSize = ZSTD_getFrameContentSize(&compressed[0], size_t(info.compressedSize))) <= FS_MAX_FILE_SIZE &&
+      info.offsetInBlock >= 0 && info.offsetInBlock <= int64_t(blockSize) - info.decompressedSize;
+    vector<char> block(equal ? size_t(blockSize) : 0);
+    equal = equal && decompress_frames(table, block.data(), block.size(), &compressed[0], size_t(info.compressedSize)) ==
+      block.size() && equalsNext(block.data() + info.offsetInBlock, size_t(info.decompressedSize));
+  }
+  else if (info.isStored())
+  {
+    compressed.resize(1 << 20);
+    for (int64_t pos = 0; equal && pos < info.decompressedSize; pos += int64_t(compressed.size()))
+    {
+      size_t size = size_t(min(int64_t(compressed.size()), info.decompressedSize - pos));
+      equal = FS_PREAD(f, &compressed[0], size, info.offsetInFile + pos) && equalsNext(&compressed[0], size);
+    }
+  }
+  else
+  {
+    ZSTD_DStream * dstream = ZSTD_createDStream();
+    compressed.resize(ZSTD_DStreamInSize());
+    vector<char> out(ZSTD_DStreamOutSize());
+    int64_t decompressed = 0;
+    for (int64_t pos = 0; equal && pos < info.compressedSize;)
+    {
+      size_t size = size_t(min(int64_t(compressed.size()), info.compressedSize - pos));
+      equal = FS_PREAD(f, &compressed[0], size, info.offsetInFile + pos);
+      if (equal && pos == 0)
+        ZSTD_DCtx_refDDict(dstream, table->findDictionary(ZSTD_getDictID_fromFrame(&compressed[0], size)));
+      pos += int64_t(size);
+
+      ZSTD_inBuffer input = { &compressed[0], size, 0 };
+      while (equal && input.pos < input.size)
+      {
+        ZSTD_outBuffer output = { &out[0], out.size(), 0 };
+        size_t res = ZSTD_decompressStream(dstream, &output, &input);
+        decompressed += int64_t(output.pos);
+        equal = !ZSTD_isError(res) && decompressed <= info.decompressedSize && equalsNext(&out[0], output.pos);
+      }
+    }
+    ZSTD_freeDStream(dstream);
+    equal = equal && decompressed == info.decompressedSize;
+  }
+
+  equal = equal && fgetc(src) == EOF; // the file is not longer than the entry
+  fclose(src);
+  return equal;
+}
+
+
+// Identical files are stored once: workers claim the content (hash and size) before compressing it, a job that
+// finds an earlier claim with the same bytes skips compression, and the writer points it at the entry written
+// for the earlier job. Claims go to the lowest job index, so the archive does not depend on the order the workers
+// run in. Matching hashes are only candidates, the bytes are always compared before a name is pointed at other
+// content, so a hash collision costs a comparison and never serves wrong bytes.
+struct PackDedup
+{
+  typedef pair<uint64_t, int64_t> Key; // content hash, size
+
+  struct Source
+  {
+    Fs8FileInfo info;
+    string fullName; // empty for entries of the archive being updated
+  };
+
+  mutex lock;
+  map<Key, pair<size_t, string>> claims; // job index, file
+  multimap<Key, Source> written;         // entries with colliding hashes go side by side
+
+  // entries of the archive being updated are compared by decompressing them (see addArchiveEntry())
+  FILE * archive = nullptr;
+  const Fs8FileTable * archiveTable = nullptr;
+
+  bool sameContent(const Source & source, const string & full_name) const
+  {
+    return source.fullName.empty() ? entry_equals_file(archive, archiveTable, source.info, full_name) :
+      files_equal(source.fullName, full_name);
+  }
+
+  // false - 'full_name' has the bytes of an earlier job or written entry, it need not be compressed
+  bool claim(uint64_t hash, int64_t size, size_t job_index, const string & full_name)
+  {
+    vector<Source> candidates;
+    string claimedFile;
+    {
+      lock_guard<mutex> guard(lock);
+      Key key(hash, size);
+      auto range = written.equal_range(key);
+      for (auto it = range.first; it != range.second; ++it)
+        candidates.push_back(it->second);
+
+      auto res = claims.emplace(key, make_pair(job_index, full_name));
+      if (!res.second && res.first->second.first > job_index)
+        res.first->second = make_pair(job_index, full_name);
+      if (res.first->second.first != job_index)
+        claimedFile = res.first->second.second;
+    }
+
+    // files are compared without the lock
+    for (auto & c : candidates)
+      if (sameContent(c, full_name))
+        return false;
+    return claimedFile.empty() || !files_equal(claimedFile, full_name);
+  }
+
+  // an entry already written (or in the archive being updated) with the bytes of 'full_name'
+  bool findWritten(uint64_t hash, int64_t size, const string & full_name, Fs8FileInfo & out_info)
+  {
+    vector<Source> candidates;
+    {
+      lock_guard<mutex> guard(lock);
+      auto range = written.equal_range(Key(hash, size));
+      for (auto it = range.first; it != range.second; ++it)
+        candidates.push_back(it->second);
+    }
+
+    for (auto & c : candidates)
+      if (sameContent(c, full_name))
+      {
+        out_info = c.info;
+        return true;
+      }
+    return false;
+  }
+
+  void addWritten(const Fs8FileInfo & info, const string & full_name)
+  {
+    lock_guard<mutex> guard(lock);
+    written.emplace(Key(info.contentHash, info.decompressedSize), Source{ info, full_name });
+  }
+
+  // 'archive' and 'archiveTable' must be set
+  void addArchiveEntry(const Fs8FileInfo & info)
+  {
+    addWritten(info, string());
+  }
+};
+
+
+// Packer workers read files into this buffer and compress them into PackedBlob::compressedData taken from
+// the free list of the pipeline, so packing many small files does not allocate per file.
+// A buffer grown above FS_PACK_REUSED_BUFFER_SIZE by a solid block is freed after use.
+static thread_local vector<char> pack_read_buffer;
+
+static void trim_pack_buffer(vector<char> & buf)
+{
+  if (buf.capacity() > FS_PACK_REUSED_BUFFER_SIZE)
+    vector<char>().swap(buf);
+}
+
+
+// appends the file to 'buf', returns false if the file cannot be read
+static bool read_file_to_buffer(const string & file_name_utf8, vector<char> & buf, size_t & size)
+{
+  size = 0;
+  FILE * f = FS_FOPEN(file_name_utf8.c_str(), "rb");
+  if (!f)
+    return false;
+
+  bool ok = FS_FSEEK(f, 0, SEEK_END) == 0;
+  int64_t fileSize = ok ? FS_FTELL(f) : -1;
+  ok = fileSize >= 0 && FS_FSEEK(f, 0, SEEK_SET) == 0;
+  if (ok && fileSize > 0)
+  {
+    size_t pos = buf.size();
+    buf.resize(pos + size_t(fileSize));
+    ok = fread(&buf[pos], size_t(fileSize), 1, f) == 1;
+    if (!ok)
+      buf.resize(pos);
+  }
+  fclose(f);
+
+  if (ok)
+    size = size_t(fileSize);
+  return ok;
+}
+
+
+// files that do not compress better than options.storeRatio are written as is
+// returns the compressed size or a zstd error code, 'out' is large enough to store the file as is
+static size_t compress_whole(const char * data, size_t size, const ZSTD_CDict * dictionary, const Fs8PackOptions & options,
+  vector<char> & out)
+{
+  size_t compressBounds = max(ZSTD_compressBound(size), size);
+  out.resize(compressBounds);
+  if (dictionary)
+    return ZSTD_compress_usingCDict(zstd_compress_context.get(), &out[0], compressBounds, data, size, dictionary);
+  return ZSTD_compressCCtx(zstd_compress_context.get(), &out[0], compressBounds, data, size, options.compressionLevel);
+}
+
+
+// Fs8ChunkTable followed by one zstd frame per options.chunkSize bytes
+static size_t compress_chunks(const char * data, size_t size, int64_t chunk_count, const Fs8PackOptions & options,
+  vector<char> & out)
+{
+  size_t chunkSize = size_t(options.chunkSize);
+  size_t tableSize = size_t(chunk_table_size(chunk_count));
+  size_t compressBounds = tableSize;
+  for (size_t pos = 0; pos < size; pos += chunkSize)
+    compressBounds += ZSTD_compressBound(min(chunkSize, size - pos));
+  out.resize(max(compressBounds, size));
+
+  Fs8ChunkTable table;
+  init_chunk_table(table, chunk_count, options.chunkSize);
+  memcpy(&out[0], &table, sizeof(table));
+
+  size_t outPos = tableSize;
+  for (int64_t i = 0; i < chunk_count; i++)
+  {
+    uint64_t frameOffset = outPos;
+    memcpy(&out[sizeof(table) + i * sizeof(uint64_t)], &frameOffset, sizeof(uint64_t));
+
+    size_t pos = size_t(i) * chunkSize;
+    size_t res = ZSTD_compressCCtx(zstd_compress_context.get(), &out[outPos], compressBounds - outPos,
+      data + pos, min(chunkSize, size - pos), options.compressionLevel);
+    if (ZSTD_isError(res))
+      return res;
+    outPos += res;
+  }
+
+  uint64_t endOffset = outPos;
+  memcpy(&out[sizeof(table) + chunk_count * sizeof(uint64_t)], &endOffset, sizeof(uint64_t));
+  return outPos;
+}
+
+
+static bool pack_file_blob(const string & full_name, const ZSTD_CDict * dictionary, const Fs8PackOptions & options,
+  PackDedup * dedup, size_t job_index, PackedBlob & blob)
+{
+  vector<char> & readBuffer = pack_read_buffer;
+  readBuffer.clear();
+
+  size_t fileSize = 0;
+  if (!read_file_to_buffer(full_name, readBuffer, fileSize))
+    return false;
+  const char * fileData = readBuffer.data();
+
+  blob.contentHash = hash_content(fileData, fileSize);
+  if (dedup && !dedup->claim(blob.contentHash, int64_t(fileSize), job_index, full_name))
+  {
+    trim_pack_buffer(readBuffer);
+    blob.duplicate = true;
+    blob.fileSize = fileSize;
+    return true;
+  }
+
+  int64_t chunkCount = get_chunk_count(int64_t(fileSize), options.chunkSize);
+  size_t compressedSize = chunkCount ? compress_chunks(fileData, fileSize, chunkCount, options, blob.compressedData) :
+    compress_whole(fileData, fileSize, dictionary, options, blob.compressedData);
+
+  if (chunkCount && !ZSTD_isError(compressedSize))
+    blob.flags |= FS8_ENTRY_CHUNKED;
+
+  bool ok = !ZSTD_isError(compressedSize);
+  if (!ok)
+    Fs8FileSystem::errorLogCallback((string("ZSTD compression error: ") + ZSTD_getErrorName(compressedSize)).c_str());
+  else if (fileSize == 0)
+    compressedSize = 0; // nothing to read, no need for a zstd frame
+  else if (double(compressedSize) > double(fileSize) * options.storeRatio)
+  {
+    memcpy(&blob.compressedData[0], fileData, fileSize);
+    compressedSize = fileSize;
+    blob.flags = FS8_ENTRY_STORED;
+  }
+
+  if (ok)
+  {
+    blob.compressedData.resize(compressedSize);
+    blob.compressedSize = compressedSize;
+    blob.fileSize = fileSize;
+  }
+
+  trim_pack_buffer(readBuffer);
+  return ok;
+}
+
+
+// files of a solid block are concatenated and compressed as one frame
+static bool pack_block_blob(const PackJob & job, const Fs8PackOptions & options, PackedBlob & blob)
+{
+  vector<char> & blockData = pack_read_buffer;
+  blockData.clear();
+
+  bool ok = true;
+  for (auto & f : job.blockFiles)
+  {
+    size_t pos = blockData.size();
+    size_t fileSize = 0;
+    if (!read_file_to_buffer(f.fullName, blockData, fileSize))
+    {
+      Fs8FileSystem::errorLogCallback((string("Cannot read file ") + f.fullName).c_str());
+      ok = false;
+      break;
+    }
+    blob.blockFileSizes.push_back(int64_t(fileSize));
+    blob.blockFileHashes.push_back(hash_content(blockData.data() + pos, fileSize));
+  }
+
+  size_t compressedSize = 0;
+  if (ok)
+  {
+    compressedSize = compress_whole(blockData.data(), blockData.size(), nullptr, options, blob.compressedData);
+    ok = !ZSTD_isError(compressedSize);
+    if (!ok)
+      Fs8FileSystem::errorLogCallback((string("ZSTD compression error: ") + ZSTD_getErrorName(compressedSize)).c_str());
+  }
+
+  if (ok)
+  {
+    if (double(compressedSize) > double(blockData.size()) * options.storeRatio)
+    {
+      memcpy(&blob.compressedData[0], blockData.data(), blockData.size());
+      compressedSize = blockData.size();
+      blob.flags = FS8_ENTRY_STORED;
+    }
+    blob.compressedData.resize(compressedSize);
+    blob.compressedSize = compressedSize;
+    blob.fileSize = blockData.size();
+  }
+
+  trim_pack_buffer(blockData);
+  return ok;
+}
+
+
+static bool pack_job_blob(const PackJob & job, const Fs8PackOptions & options, PackDedup * dedup, size_t job_index,
+  PackedBlob & blob)
+{
+  return job.blockFiles.empty() ? pack_file_blob(job.fullName, job.dictionary, options, dedup, job_index, blob) :
+    pack_block_blob(job, options, blob);
+}
+
+
+// Compresses the file straight to 'outf' with constant memory, zstd uses 'threads' workers for it.
+// Falls back to storing the file when it does not compress better than options.storeRatio.
+static bool pack_file_stream(const string & full_name, FILE * outf, const Fs8PackOptions & options, int threads,
+  Fs8FileInfo & info, int64_t & max_written_pos)
+{
+  FILE * f = FS_FOPEN(full_name.c_str(), "rb");
+  if (!f)
+    return false;
+
+  int64_t fileSize = get_file_size(full_name);
+  info.offsetInFile = FS_FTELL(outf);
+  info.decompressedSize = fileSize;
+  info.flags = 0;
+
+  ZSTD_CCtx * ctx = zstd_compress_context.get();
+  ZSTD_CCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+  ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, options.compressionLevel);
+  // output of zstd workers does not depend on their number, so the archive is the same for any 'threads',
+  // fails harmlessly if zstd is built without threads
+  ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, max(threads, 1));
+
+  // a chunked file is a sequence of frames of options.chunkSize bytes, its table is written when the offsets are known
+  int64_t chunkCount = get_chunk_count(fileSize, options.chunkSize);
+  int64_t frameSize = chunkCount ? options.chunkSize : fileSize;
+  vector<uint64_t> frameOffsets;
+  if (chunkCount)
+  {
+    vector<char> placeholder(size_t(chunk_table_size(chunkCount)), 0);
+    if (fwrite(&placeholder[0], placeholder.size(), 1, outf) != 1)
+    {
+      fclose(f);
+      return false;
+    }
+  }
+
+  vector<char> inBuf(ZSTD_CStreamInSize());
+  vector<char> outBuf(ZSTD_CStreamOutSize());
+  int64_t readTotal = 0;
+  bool ok = true;
+  Fs8ContentHasher hasher;
+
+  while (ok && readTotal < fileSize)
+  {
+    if (chunkCount)
+      frameOffsets.push_back(uint64_t(FS_FTELL(outf) - info.offsetInFile));
+
+    int64_t frameLeft = min(frameSize, fileSize - readTotal);
+    ZSTD_CCtx_setPledgedSrcSize(ctx, uint64_t(frameLeft));
+
+    while (ok && frameLeft > 0)
+    {
+      size_t wantBytes = size_t(min(int64_t(inBuf.size()), frameLeft));
+      size_t readBytes = fread(&inBuf[0], 1, wantBytes, f);
+      if (readBytes != wantBytes)
+      {
+        ok = false; // the file was changed while packing
+        break;
+      }
+      readTotal += int64_t(readBytes);
+      frameLeft -= int64_t(readBytes);
+      hasher.update(&inBuf[0], readBytes);
+
+      ZSTD_EndDirective mode = frameLeft == 0 ? ZSTD_e_end : ZSTD_e_continue;
+      ZSTD_inBuffer input = { &inBuf[0], readBytes, 0 };
+      bool finished = false;
+      while (!finished)
+      {
+        ZSTD_outBuffer output = { &outBuf[0], outBuf.size(), 0 };
+        size_t remaining = ZSTD_compressStream2(ctx, &output, &input, mode);
+        if (ZSTD_isError(remaining))
+        {
+          Fs8FileSystem::errorLogCallback((string("ZSTD compression error: ") + ZSTD_getErrorName(remaining)).c_str());
+          ok = false;
+          break;
+        }
+        if (output.pos > 0 && fwrite(&outBuf[0], output.pos, 1, outf) != 1)
+        {
+          ok = false;
+          break;
+        }
+        finished = mode == ZSTD_e_end ? (remaining == 0) : (input.pos == input.size);
+      }
+    }
+  }
+
+  if (ok && chunkCount)
+  {
+    int64_t endPos = FS_FTELL(outf);
+    frameOffsets.push_back(uint64_t(endPos - info.offsetInFile));
+    Fs8ChunkTable table;
+    init_chunk_table(table, chunkCount, options.chunkSize);
+    FS_FSEEK(outf, info.offsetInFile, SEEK_SET);
+    ok = fwrite(&table, sizeof(table), 1, outf) == 1 &&
+      fwrite(&frameOffsets[0], frameOffsets.size() * sizeof(uint64_t), 1, outf) == 1;
+    FS_FSEEK(outf, endPos, SEEK_SET);
+    info.flags |= FS8_ENTRY_CHUNKED;
+  }
+
+  ZSTD_CCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+
+  if (!ok)
+  {
+    fclose(f);
+    return false;
+  }
+
+  info.compressedSize = FS_FTELL(outf) - info.offsetInFile;
+  info.contentHash = hasher.digest();
+  max_written_pos = max(max_written_pos, FS_FTELL(outf));
+
+  if (fileSize > 0 && double(info.compressedSize) > double(fileSize) * options.storeRatio)
+  {
+    FS_FSEEK(f, 0, SEEK_SET);
+    FS_FSEEK(outf, info.offsetInFile, SEEK_SET);
+    size_t readBytes = 0;
+    while (ok && (readBytes = fread(&inBuf[0], 1, inBuf.size(), f)) > 0)
+      ok = fwrite(&inBuf[0], readBytes, 1, outf) == 1;
+    info.compressedSize = fileSize;
+    info.flags = FS8_ENTRY_STORED;
+    ok = ok && FS_FTELL(outf) == info.offsetInFile + fileSize;
+  }
+
+  fclose(f);
+  return ok;
+}
+
+
+// files of one type (extension) share a dictionary or go next to each other in solid blocks
+static string get_dictionary_group(const string & archive_name)
+{
+  size_t slash = archive_name.find_last_of('/');
+  size_t dot = archive_name.find_last_of('.');
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+    return string();
+  string group = archive_name.substr(dot + 1);
+  normalize_file_name(group);
+  return group;
+}
+
+
+// Small files are sorted by directory and extension (neighbours are usually loaded together and compress
+// well together) and packed into solid blocks of options.solidBlockSize, the blocks go after the other files.
+static void make_solid_blocks(vector<PackJob> & jobs, const Fs8PackOptions & options)
+{
+  struct SmallFile
+  {
+    string directory;
+    string extension;
+    int64_t size;
+    PackJob job;
+  };
+
+  vector<PackJob> rest;
+  vector<SmallFile> small;
+  for (auto & job : jobs)
+  {
+    int64_t size = get_file_size(job.fullName);
+    if (size <= 0 || size > options.solidFileSizeLimit)
+    {
+      rest.push_back(move(job));
+      continue;
+    }
+
+    size_t slash = job.archiveName.find_last_of('/');
+    string directory = slash == string::npos ? string() : job.archiveName.substr(0, slash);
+    normalize_file_name(directory);
+    small.push_back(SmallFile{ directory, get_dictionary_group(job.archiveName), size, move(job) });
+  }
+
+  stable_sort(small.begin(), small.end(), [](const SmallFile & a, const SmallFile & b)
+    {
+      if (a.directory != b.directory)
+        return a.directory < b.directory;
+      return a.extension < b.extension;
+    });
+
+  PackJob block;
+  int64_t blockSize = 0;
+  for (size_t i = 0; i < small.size(); i++)
+  {
+    block.blockFiles.push_back(move(small[i].job));
+    blockSize += small[i].size;
+    if (blockSize >= options.solidBlockSize || i + 1 == small.size())
+    {
+      if (block.blockFiles.size() == 1)
+        rest.push_back(move(block.blockFiles[0]));
+      else
+        rest.push_back(move(block));
+      block = PackJob();
+      blockSize = 0;
+    }
+  }
+
+  jobs.swap(rest);
+}
+
+
+struct PackDictionary
+{
+  vector<char> bytes;
+  ZSTD_CDict * cdict = nullptr;
+
+  ~PackDictionary()
+  {
+    ZSTD_freeCDict(cdict);
+  }
+};
+
+
+
+// Small files are grouped by extension, every group with FS_DICT_MIN_SAMPLES files gets its own dictionary,
+// the rest share one. Files of a group that cannot be trained (too few or too similar samples) are
+// compressed without a dictionary.
+static void train_dictionaries(vector<PackJob> & jobs, const Fs8PackOptions & options,
+  vector<unique_ptr<PackDictionary>> & dictionaries, vector<Fs8IndexSectionData> & sections)
+{
+  map<string, vector<size_t>> groups;
+  for (size_t i = 0; i < jobs.size(); i++)
+  {
+    int64_t size = get_file_size(jobs[i].fullName);
+    if (size > 0 && size <= options.dictionaryFileSizeLimit)
+      groups[get_dictionary_group(jobs[i].archiveName)].push_back(i);
+  }
+
+  vector<pair<string, vector<size_t>>> largest(groups.begin(), groups.end());
+  stable_sort(largest.begin(), largest.end(), [](const pair<string, vector<size_t>> & a, const pair<string, vector<size_t>> & b)
+    { return a.second.size() > b.second.size(); });
+
+  vector<vector<size_t>> trainGroups;
+  vector<size_t> common;
+  for (auto & group : largest)
+    if (group.second.size() >= FS_DICT_MIN_SAMPLES && trainGroups.size() + 1 < FS_DICT_MAX_COUNT)
+      trainGroups.push_back(move(group.second));
+    else
+      common.insert(common.end(), group.second.begin(), group.second.end());
+
+  sort(common.begin(), common.end());
+  trainGroups.push_back(move(common));
+
+  size_t sampleBudget = size_t(min(options.dictionarySize * FS_DICT_SAMPLES_PER_BYTE, int64_t(FS_DICT_MAX_SAMPLES_SIZE)));
+  for (auto & group : trainGroups)
+  {
+    if (group.size() < FS_DICT_MIN_SAMPLES)
+      continue;
+
+    string samples;
+    vector<size_t> sampleSizes;
+    for (size_t job : group)
+    {
+      if (samples.size() >= sampleBudget)
+        break;
+      size_t size = 0;
+      const char * data = read_whole_file(jobs[job].fullName.c_str(), size);
+      if (!data)
+        continue;
+      samples.append(data, size);
+      sampleSizes.push_back(size);
+      delete[] data;
+    }
+
+    unique_ptr<PackDictionary> dict(new PackDictionary);
+    dict->bytes.resize(size_t(options.dictionarySize));
+    size_t dictSize = ZDICT_trainFromBuffer(&dict->bytes[0], dict->bytes.size(), samples.data(), sampleSizes.data(),
+      unsigned(sampleSizes.size()));
+    if (ZDICT_isError(dictSize))
+      continue;
+    dict->bytes.resize(dictSize);
+
+    unsigned dictId = ZDICT_getDictID(&dict->bytes[0], dictSize);
+    bool duplicateId = false;
+    for (auto & d : dictionaries)
+      duplicateId = duplicateId || ZDICT_getDictID(&d->bytes[0], d->bytes.size()) == dictId;
+    if (dictId == 0 || duplicateId)
+      continue;
+
+    dict->cdict = ZSTD_createCDict(&dict->bytes[0], dictSize, options.compressionLevel);
+    if (!dict->cdict)
+      continue;
+
+    for (size_t job : group)
+      jobs[job].dictionary = dict->cdict;
+    dictionaries.push_back(move(dict));
+  }
+
+  if (dictionaries.empty())
+    return;
+
+  Fs8IndexSectionData section;
+  section.id = FS8_SECTION_DICTIONARIES;
+  uint32_t count = uint32_t(dictionaries.size());
+  section.bytes.resize(size_t(align8(8 + uint64_t(count) * 8)), 0);
+  memcpy(&section.bytes[0], &count, 4);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint64_t dictSize = dictionaries[i]->bytes.size();
+    memcpy(&section.bytes[8 + i * 8], &dictSize, 8);
+    section.bytes.insert(section.bytes.end(), dictionaries[i]->bytes.begin(), dictionaries[i]->bytes.end());
+    section.bytes.resize(size_t(align8(section.bytes.size())), 0);
+  }
+  sections.push_back(move(section));
+}
+
+
+// Workers read and compress files out of order, the writer (calling thread) takes results strictly
+// in job order, so the archive is byte-identical to the single threaded one.
+// Memory is bounded by FS_PACK_MAX_JOBS_IN_FLIGHT jobs and FS_PACK_MAX_BYTES_IN_FLIGHT bytes,
+// the job next to be written is always allowed to run, so a single huge file cannot stall the pipeline.
+struct PackPipeline
+{
+  const vector<PackJob> & jobs;
+  const Fs8PackOptions & options;
+  PackDedup & dedup;
+  vector<PackedBlob> slots;
+  vector<vector<char>> freeBuffers; // compressedData of written blobs, reused by the workers
+  vector<thread> workers;
+
+  mutex lock;
+  condition_variable workerCondition;
+  condition_variable writerCondition;
+  size_t nextJob = 0;
+  size_t nextToWrite = 0;
+  int64_t bytesInFlight = 0;
+  bool stop = false;
+
+  PackPipeline(const vector<PackJob> & jobs_, const Fs8PackOptions & options_, PackDedup & dedup_, int threads) :
+    jobs(jobs_), options(options_), dedup(dedup_)
+  {
+    slots.resize(min(jobs.size(), size_t(max(threads * 4, FS_PACK_MAX_JOBS_IN_FLIGHT))));
+    for (int i = 0; i < threads; i++)
+      workers.emplace_back([this]() { workerLoop(); });
+  }
+
+  ~PackPipeline()
+  {
+    {
+      lock_guard<mutex> guard(lock);
+      stop = true;
+    }
+    workerCondition.notify_all();
+    for (auto & w : workers)
+      w.join();
+  }
+
+  void workerLoop()
+  {
+    for (;;)
+    {
+      size_t index = 0;
+      {
+        unique_lock<mutex> guard(lock);
+        workerCondition.wait(guard, [this]() { return stop || (nextJob < jobs.size() && nextJob < nextToWrite + slots.size()); });
+        if (stop || nextJob >= jobs.size())
+          return;
+        index = nextJob++;
+      }
+
+      int64_t fileSize = get_job_size(jobs[index]);
+      if (fileSize > FS_PACK_REUSED_BUFFER_SIZE && jobs[index].blockFiles.empty())
+      {
+        {
+          lock_guard<mutex> guard(lock);
+          PackedBlob & blob = slots[index % slots.size()];
+          blob.done = true;
+          blob.ok = true;
+          blob.streamed = true;
+        }
+        writerCondition.notify_one();
+        continue;
+      }
+
+      int64_t reserve = fileSize + int64_t(ZSTD_compressBound(size_t(fileSize)));
+      {
+        unique_lock<mutex> guard(lock);
+        workerCondition.wait(guard, [&]() { return stop || index == nextToWrite || bytesInFlight + reserve <= FS_PACK_MAX_BYTES_IN_FLIGHT; });
+        if (stop)
+          return;
+        bytesInFlight += reserve;
+      }
+
+      PackedBlob blob;
+      {
+        lock_guard<mutex> guard(lock);
+        if (!freeBuffers.empty())
+        {
+          blob.compressedData.swap(freeBuffers.back());
+          freeBuffers.pop_back();
+        }
+      }
+
+      blob.ok = pack_job_blob(jobs[index], options, &dedup, index, blob);
+      blob.done = true;
+      if (!blob.ok)
+        blob.compressedData.clear();
+      blob.reservedBytes = int64_t(blob.compressedData.capacity());
+
+      {
+        lock_guard<mutex> guard(lock);
+        bytesInFlight -= reserve - blob.reservedBytes;
+        slots[index % slots.size()] = move(blob);
+      }
+      writerCondition.notify_one();
+      workerCondition.notify_all();
+    }
+  }
+
+  // blocks until job 'index' is compressed, the blob must be released with release()
+  PackedBlob & take(size_t index)
+  {
+    unique_lock<mutex> guard(lock);
+    PackedBlob & blob = slots[index % slots.size()];
+    writerCondition.wait(guard, [&]() { return blob.done; });
+    return blob;
+  }
+
+  void release(size_t index)
+  {
+    {
+      lock_guard<mutex> guard(lock);
+      PackedBlob & blob = slots[index % slots.size()];
+      bytesInFlight -= blob.reservedBytes;
+      if (blob.compressedData.capacity() > 0 && blob.compressedData.capacity() <= FS_PACK_REUSED_BUFFER_SIZE &&
+          freeBuffers.size() < workers.size() * 2)
+      {
+        freeBuffers.push_back(move(blob.compressedData));
+        freeBuffers.back().clear();
+      }
+      blob = PackedBlob();
+      nextToWrite = index + 1;
+    }
+    workerCondition.notify_all();
+  }
+};
+
+
+// 'dir' without the trailing slash
+static void make_pack_jobs(const string & dir, const vector<pair<string, string>> & file_names, vector<string> * ignore_list,
+  vector<PackJob> & jobs)
+{
+  jobs.reserve(file_names.size());
+
+  for (auto & namePair : file_names)
+  {
+    string name = namePair.first;
+    string archiveName = namePair.second.empty() ? name : namePair.second;
+
+    for (auto & ch : name)
+      if (ch == '\\')
+        ch = '/';
+
+    if (!archiveName.empty())
+      if (archiveName.back() == '/' || archiveName.back() == '\\')
+      {
+        string fn = name;
+        if (const char * p = strrchr(fn.c_str(), '/'))
+          fn = p + 1;
+        archiveName += fn;
+      }
+
+    for (auto & ch : archiveName)
+      if (ch == '\\')
+        ch = '/';
+
+
+    if (ignore_list && !name.empty())
+    {
+      bool skip = false;
+      for (auto & ignore : *ignore_list)
+      {
+        if (ignore == ".")
+          if (name[0] == '.' || name.find("/.") != string::npos)
+            skip = true;
+
+        string s_ignore = string("/") + ignore;
+        string ignore_s = ignore + "/";
+        string s_ignore_s = string("/") + ignore + "/";
+        if (name.find(s_ignore_s) != string::npos || name.find(ignore_s) == 0 || name == ignore)
+          skip = true;
+        size_t pos = name.rfind(s_ignore);
+        if (pos != string::npos && pos + s_ignore.length() == name.length())
+          skip = true;
+
+        if (skip)
+          break;
+      }
+
+      if (skip)
+        continue;
+    }
+
+    PackJob job;
+    job.fullName = dir.empty() ? name : dir + "/" + name;
+    job.archiveName = archiveName;
+    jobs.push_back(move(job));
+  }
+}
+
+
+// compresses the jobs and writes them at the current position of 'outf', adds their entries to 'fs_file_infos',
+// files with the content of an entry in 'dedup' are not written again
+static bool write_pack_jobs(const vector<PackJob> & jobs, FILE * outf, const string & out_file_name_utf8,
+  const Fs8PackOptions & options, int threads, PackDedup & dedup, FileInfosMap & fs_file_infos, int64_t & maxWrittenPos)
+{
+  unique_ptr<PackPipeline> pipeline;
+  if (threads > 1 && jobs.size() > 1)
+    pipeline.reset(new PackPipeline(jobs, options, dedup, min(threads, int(jobs.size()))));
+
+  // disk space is reserved ahead of the writer, finish_archive() truncates the unused part
+  int64_t allocatedEnd = FS_FTELL(outf);
+  auto preallocate = [&](int64_t size)
+  {
+    int64_t end = FS_FTELL(outf) + size;
+    if (end <= allocatedEnd)
+      return;
+    allocatedEnd = end + FS_PACK_PREALLOCATE_STEP;
+    if (FS_PREALLOCATE(outf, allocatedEnd))
+      maxWrittenPos = max(maxWrittenPos, allocatedEnd);
+  };
+
+  vector<char> spareBuffer;
+  for (size_t i = 0; i < jobs.size(); i++)
+  {
+    PackedBlob localBlob;
+    PackedBlob & blob = pipeline ? pipeline->take(i) : localBlob;
+    if (!pipeline)
+    {
+      blob.streamed = jobs[i].blockFiles.empty() && get_file_size(jobs[i].fullName) > FS_PACK_REUSED_BUFFER_SIZE;
+      blob.compressedData.swap(spareBuffer);
+      blob.ok = blob.streamed || pack_job_blob(jobs[i], options, &dedup, i, blob);
+    }
+
+    Fs8FileInfo info;
+    if (blob.ok && blob.streamed)
+    {
+      preallocate(get_file_size(jobs[i].fullName));
+      blob.ok = pack_file_stream(jobs[i].fullName, outf, options, threads, info, maxWrittenPos);
+    }
+
+    // a worker may have compressed a duplicate before the earlier job claimed the content,
+    // a streamed duplicate is known only after it is written (the next blob overwrites it)
+    Fs8FileInfo writtenInfo;
+    bool duplicate = blob.ok && jobs[i].blockFiles.empty() &&
+      dedup.findWritten(blob.streamed ? info.contentHash : blob.contentHash,
+        blob.streamed ? info.decompressedSize : int64_t(blob.fileSize), jobs[i].fullName, writtenInfo);
+    if (duplicate && blob.streamed)
+      FS_FSEEK(outf, info.offsetInFile, SEEK_SET);
+    if (blob.duplicate && !duplicate)
+    {
+      Fs8FileSystem::errorLogCallback("Internal error (duplicate content is not written)");
+      blob.ok = false;
+    }
+
+    if (!blob.ok)
+    {
+      if (jobs[i].blockFiles.empty())
+        Fs8FileSystem::errorLogCallback((string("Cannot read file ") + jobs[i].fullName).c_str());
+      return false;
+    }
+
+    if (duplicate)
+      info = writtenInfo;
+    else if (!blob.streamed)
+    {
+      info.compressedSize = int64_t(blob.compressedSize);
+      info.decompressedSize = blob.fileSize;
+      info.offsetInFile = FS_FTELL(outf);
+      info.flags = blob.flags;
+      info.contentHash = blob.contentHash;
+    }
+
+    if (info.compressedSize > 0 && !blob.streamed && !duplicate)
+    {
+      preallocate(info.compressedSize);
+      if (fwrite(&blob.compressedData[0], blob.compressedSize, 1, outf) != 1)
+      {
+        Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
+        return false;
+      }
+    }
+
+    int64_t offsetInBlock = 0;
+    for (size_t k = 0; k < jobs[i].blockFiles.size(); k++)
+    {
+      Fs8FileInfo fileInfo = info;
+      fileInfo.decompressedSize = blob.blockFileSizes[k];
+      fileInfo.offsetInBlock = offsetInBlock;
+      fileInfo.contentHash = blob.blockFileHashes[k];
+      fileInfo.flags |= FS8_ENTRY_IN_BLOCK;
+      offsetInBlock += blob.blockFileSizes[k];
+      fs_file_infos[jobs[i].blockFiles[k].archiveName] = fileInfo;
+    }
+
+    if (jobs[i].blockFiles.empty())
+    {
+      fs_file_infos[jobs[i].archiveName] = info;
+      if (!duplicate)
+        dedup.addWritten(info, jobs[i].fullName);
+    }
+
+    if (pipeline)
+      pipeline->release(i);
+    else if (blob.compressedData.capacity() <= FS_PACK_REUSED_BUFFER_SIZE)
+      spareBuffer.swap(blob.compressedData);
+  }
+
+  return true;
+}
+
+
+// Writes the file table and the signature at the end of 'outf' ('outf' must be readable), then points
+// the header to them. Everything is on disk before the header is changed, so until then the header
+// still describes the previous archive (update), on failure the header is left as it was.
+static bool finish_archive(FILE * outf, const string & out_file_name_utf8, const FileInfosMap & fs_file_infos,
+  const vector<Fs8IndexSectionData> & sections, int64_t maxWrittenPos, int threads)
+{
+  bool aligned = write_alignment(outf);
+  int64_t fnamesPos = FS_FTELL(outf);
+
+  vector<char> fnames;
+  if (!aligned || !serialize_fs_index(fs_file_infos, sections, fnames) || fwrite(&fnames[0], fnames.size(), 1, outf) != 1)
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
+    return false;
+  }
+
+  if (!write_alignment(outf))
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
+    return false;
+  }
+  int64_t signaturesPos = FS_FTELL(outf);
+
+  char header[24];
+  if (fflush(outf) != 0 || !FS_PREAD(outf, header, sizeof(header), 0))
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot read file ") + out_file_name_utf8).c_str());
+    return false;
+  }
+  char oldHeader[24];
+  memcpy(oldHeader, header, sizeof(header));
+  memcpy(header + 8, &fnamesPos, sizeof(fnamesPos));
+  memcpy(header + 16, &signaturesPos, sizeof(signaturesPos));
+
+  if (!sign_file_chunked(outf, signaturesPos, header, threads))
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot sign file ") + out_file_name_utf8).c_str());
+    return false;
+  }
+
+  int64_t endPos = FS_FTELL(outf);
+  if ((maxWrittenPos > endPos && !FS_FTRUNCATE(outf, endPos)) || !FS_FSYNC(outf) ||
+    FS_FSEEK(outf, 0, SEEK_SET) != 0 || fwrite(header, sizeof(header), 1, outf) != 1 || !FS_FSYNC(outf))
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
+    if (FS_FSEEK(outf, 0, SEEK_SET) == 0)
+      fwrite(oldHeader, sizeof(oldHeader), 1, outf);
+    fflush(outf);
+    return false;
+  }
+
+  return true;
+}
+
+
+bool Fs8FileSystem::createFs8FromFiles(const char * dir_, const vector<pair<string, string>> & file_names_,
+  const char * out_file_name_utf8_, const Fs8PackOptions & options, vector<string> * ignore_list)
+{
+  vector<pair<string, string>> file_names = file_names_;
+
+  string dir(dir_);
+  string out_file_name_utf8(out_file_name_utf8_);
+
+  if (!expand_file_masks(dir_, file_names))
+    return false;
+
+  FileInfosMap fs_file_infos;
+
+  if (!dir.empty() && (dir.back() == '\\' || dir.back() == '/'))
+    dir.pop_back();
+
+  int threads = options.threads;
+  if (threads <= 0)
+    threads = max(int(thread::hardware_concurrency()), 1);
+
+  vector<PackJob> jobs;
+  make_pack_jobs(dir, file_names, ignore_list, jobs);
+
+  FILE * outf = FS_FOPEN(out_file_name_utf8.c_str(), "wb+"); // read back when signed
+  if (!outf)
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot open file for write ") + out_file_name_utf8).c_str());
+    return false;
+  }
+  setvbuf(outf, nullptr, _IOFBF, FS_PACK_WRITE_BUFFER);
+
+  // ID: 4,  ver: 4,  file_table_offet: 8,  sigrantures_offset: 8
+  const char * header = "FS8.3   ********XXXXXXXX";
+  if (fwrite(header, strlen(header), 1, outf) != 1)
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
+    fclose(outf);
+    FS_UNLINK(out_file_name_utf8.c_str());
+    return false;
+  }
+
+  if (options.solidBlockSize > 0)
+    make_solid_blocks(jobs, options);
+
+  vector<unique_ptr<PackDictionary>> dictionaries;
+  vector<Fs8IndexSectionData> sections;
+  if (options.dictionarySize > 0)
+    train_dictionaries(jobs, options, dictionaries, sections);
+
+  int64_t maxWrittenPos = 0; // a streamed file that falls back to stored may leave a longer tail behind
+  PackDedup dedup;
+  if (!write_pack_jobs(jobs, outf, out_file_name_utf8, options, threads, dedup, fs_file_infos, maxWrittenPos))
+  {
+    fclose(outf);
+    FS_UNLINK(out_file_name_utf8.c_str());
+    return false;
+  }
+
+  bool finished = finish_archive(outf, out_file_name_utf8, fs_file_infos, sections, maxWrittenPos, threads);
+  fclose(outf);
+  if (!finished)
+  {
+    FS_UNLINK(out_file_name_utf8.c_str());
+    return false;
+  }
+
+  if (options.writeAsHex32)
+    if (!convert_file_to_hex32(out_file_name_utf8.c_str()))
+    {
+      Fs8FileSystem::errorLogCallback((string("Cannot convert file to hex32 ") + out_file_name_utf8).c_str());
+      FS_UNLINK(out_file_name_utf8.c_str());
+      return false;
+    }
+
+  return true;
+}
+
+
+static bool hash_file(const string & full_name, vector<char> & buffer, uint64_t & out_hash)
+{
+  FILE * f = FS_FOPEN(full_name.c_str(), "rb");
+  if (!f)
+    return false;
+
+  Fs8ContentHasher hasher;
+  size_t readBytes = 0;
+  while ((readBytes = fread(&buffer[0], 1, buffer.size(), f)) > 0)
+    hasher.update(&buffer[0], readBytes);
+  bool ok = !ferror(f);
+  fclose(f);
+
+  out_hash = hasher.digest();
+  return ok;
+}
+
+
+// sections of the old table that stay valid for the new one (entries reference dictionaries by ID),
+// per-entry sections are rebuilt by build_fs_index()
+static void copy_table_sections(const Fs8Index & index, vector<Fs8IndexSectionData> & sections)
+{
+  const char * data = nullptr;
+  uint64_t size = 0;
+  if (index.section(FS8_SECTION_DICTIONARIES, data, size))
+  {
+    Fs8IndexSectionData dictionaries;
+    dictionaries.id = FS8_SECTION_DICTIONARIES;
+    dictionaries.bytes.assign(data, data + size);
+    sections.push_back(move(dictionaries));
+  }
+}
+
+
+bool Fs8FileSystem::updateFs8FromFiles(const char * dir_, const vector<pair<string, string>> & file_names_,
+  const char * fs8_file_name_utf8_, const Fs8PackOptions & options, vector<string> * ignore_list)
+{
+  vector<pair<string, string>> file_names = file_names_;
+
+  string dir(dir_);
+  string fs8_file_name_utf8(fs8_file_name_utf8_);
+
+  if (!expand_file_masks(dir_, file_names))
+    return false;
+
+  if (!dir.empty() && (dir.back() == '\\' || dir.back() == '/'))
+    dir.pop_back();
+
+  int threads = options.threads;
+  if (threads <= 0)
+    threads = max(int(thread::hardware_concurrency()), 1);
+
+  FILE * f = options.writeAsHex32 ? nullptr : FS_FOPEN(fs8_file_name_utf8.c_str(), "rb+");
+  if (!f)
+    return createFs8FromFiles(dir_, file_names_, fs8_file_name_utf8_, options, ignore_list);
+  setvbuf(f, nullptr, _IOFBF, FS_PACK_WRITE_BUFFER);
+
+  shared_ptr<Fs8FileTable> table = read_file_table(f, fs8_file_name_utf8.c_str(), 0);
+  if (!table)
+  {
+    fclose(f);
+    return false;
+  }
+
+  // archives of older versions have nothing to compare with
+  if (table->index.contentHashesOffset == 0)
+  {
+    fclose(f);
+    return createFs8FromFiles(dir_, file_names_, fs8_file_name_utf8_, options, ignore_list);
+  }
+
+  vector<PackJob> jobs;
+  make_pack_jobs(dir, file_names, ignore_list, jobs);
+
+  // a file is unchanged if the archive has it with the same size and content hash, files are hashed in parallel
+  vector<Fs8FileInfo> unchangedInfos(jobs.size());
+  vector<char> unchanged(jobs.size(), 0);
+  atomic<size_t> nextJob(0);
+  auto compare = [&]()
+  {
+    vector<char> buffer(1 << 20);
+    for (size_t i = nextJob++; i < jobs.size(); i = nextJob++)
+    {
+      string name = jobs[i].archiveName;
+      normalize_file_name(name);
+      Fs8FileInfo info;
+      uint64_t hash = 0;
+      if (table->find(name, info) && info.contentHash != 0 && info.decompressedSize == get_file_size(jobs[i].fullName) &&
+        hash_file(jobs[i].fullName, buffer, hash) && hash == info.contentHash)
+      {
+        unchangedInfos[i] = info;
+        unchanged[i] = 1;
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < min(threads, int(jobs.size())); i++)
+    workers.emplace_back(compare);
+  compare();
+  for (auto & w : workers)
+    w.join();
+
+  FileInfosMap fs_file_infos;
+  vector<PackJob> changedJobs;
+  for (size_t i = 0; i < jobs.size(); i++)
+    if (unchanged[i])
+      fs_file_infos[jobs[i].archiveName] = unchangedInfos[i];
+    else
+      changedJobs.push_back(move(jobs[i]));
+
+  if (changedJobs.empty() && fs_file_infos.size() == table->index.size())
+  {
+    fclose(f);
+    return true;
+  }
+
+  vector<Fs8IndexSectionData> sections;
+  copy_table_sections(table->index, sections);
+
+  // new blobs and the new table go after the signature, the header is switched to them at the end
+  FS_FSEEK(f, 0, SEEK_END);
+  int64_t oldSize = FS_FTELL(f);
+
+  // changed files may have the content of any entry already in the archive
+  PackDedup dedup;
+  dedup.archive = f;
+  dedup.archiveTable = table.get();
+  for (size_t i = 0; i < table->index.size(); i++)
+  {
+    Fs8FileInfo info;
+    if (table->index.entryInfo(i, info) && info.contentHash != 0)
+      dedup.addArchiveEntry(info);
+  }
+
+  // on failure the header still points to the old table, the appended bytes are cut off
+  int64_t maxWrittenPos = 0;
+  bool ok = write_alignment(f);
+  if (!ok)
+    Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + fs8_file_name_utf8).c_str());
+  if (!ok ||
+    !write_pack_jobs(changedJobs, f, fs8_file_name_utf8, options, threads, dedup, fs_file_infos, maxWrittenPos) ||
+    !finish_archive(f, fs8_file_name_utf8, fs_file_infos, sections, maxWrittenPos, threads))
+  {
+    FS_FTRUNCATE(f, oldSize);
+    fclose(f);
+    return false;
+  }
+
+  return fclose(f) == 0;
+}
+
+
+bool Fs8FileSystem::compactFs8(const char * fs8_file_name_utf8_)
+{
+  string fs8_file_name_utf8(fs8_file_name_utf8_);
+  string tmpFileName = fs8_file_name_utf8 + ".compact.tmp";
+
+  FILE * f = FS_FOPEN(fs8_file_name_utf8.c_str(), "rb");
+  if (!f)
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot open file ") + fs8_file_name_utf8).c_str());
+    return false;
+  }
+
+  shared_ptr<Fs8FileTable> table = read_file_table(f, fs8_file_name_utf8.c_str(), 0);
+  if (!table)
+  {
+    fclose(f);
+    return false;
+  }
+
+  FILE * outf = FS_FOPEN(tmpFileName.c_str(), "wb+"); // read back when signed
+  if (!outf)
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot open file for write ") + tmpFileName).c_str());
+    fclose(f);
+    return false;
+  }
+  setvbuf(outf, nullptr, _IOFBF, FS_PACK_WRITE_BUFFER);
+
+  // ID: 4,  ver: 4,  file_table_offet: 8,  sigrantures_offset: 8
+  const char * header = "FS8.3   ********XXXXXXXX";
+  bool ok = fwrite(header, strlen(header), 1, outf) == 1;
+
+  // live blobs are copied in archive order, a solid block shared by several entries is copied once
+  const Fs8Index & index = table->index;
+  vector<pair<pair<int64_t, int64_t>, size_t>> order; // (offsetInFile, compressedSize), entry
+  order.reserve(index.size());
+  for (size_t i = 0; i < index.size(); i++)
+  {
+    Fs8FileInfo info;
+    index.entryInfo(i, info);
+    order.push_back(make_pair(make_pair(info.offsetInFile, info.compressedSize), i));
+  }
+  sort(order.begin(), order.end());
+
+  FileInfosMap fs_file_infos;
+  vector<char> buffer(1 << 20);
+  pair<int64_t, int64_t> prevBlob(-1, -1);
+  int64_t newOffset = 0;
+  for (size_t k = 0; ok && k < order.size(); k++)
+  {
+    Fs8FileInfo info;
+    if (!index.entryInfo(order[k].second, info))
+    {
+      Fs8FileSystem::errorLogCallback("Corrupted file (unknown entry flags)");
+      ok = false;
+      break;
+    }
+
+    if (order[k].first != prevBlob)
+    {
+      prevBlob = order[k].first;
+      newOffset = FS_FTELL(outf);
+      for (int64_t pos = 0; ok && pos < info.compressedSize; pos += int64_t(buffer.size()))
+      {
+        size_t size = size_t(min(int64_t(buffer.size()), info.compressedSize - pos));
+        ok = FS_PREAD(f, &buffer[0], size, info.offsetInFile + pos) && fwrite(&buffer[0], size, 1, outf) == 1;
+      }
+    }
+
+    const char * name = nullptr;
+    size_t length = 0;
+    ok = ok && index.entryName(order[k].second, name, length);
+    info.offsetInFile = newOffset;
+    if (ok)
+      fs_file_infos[string(name, length)] = info;
+  }
+
+  vector<Fs8IndexSectionData> sections;
+  copy_table_sections(index, sections);
+  fclose(f);
+
+  if (!ok)
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot compact file ") + fs8_file_name_utf8).c_str());
+    fclose(outf);
+    FS_UNLINK(tmpFileName.c_str());
+    return false;
+  }
+
+  bool finished = finish_archive(outf, tmpFileName, fs_file_infos, sections, 0, 0);
+  fclose(outf);
+  if (!finished)
+  {
+    FS_UNLINK(tmpFileName.c_str());
+    return false;
+  }
+
+  // the original archive stays in place until it is replaced, on failure the compacted copy is kept
+  if (!FS_RENAME(tmpFileName.c_str(), fs8_file_name_utf8.c_str()))
+  {
+    Fs8FileSystem::errorLogCallback((string("Cannot replace file ") + fs8_file_name_utf8 + " with " + tmpFileName).c_str());
+    return false;
+  }
+  return true;
+}
+
+
+static void cancel_prefetch_and_wait(const Fs8FileSystem * owner, const atomic<int> & owner_tasks);
+
+bool Fs8FileSystem::initalizeFromFile(const char * fs8_file_name_utf8, bool memory_mapped)
+{
+  cancel_prefetch_and_wait(this, prefetchTasks);
+
+  string fullName = get_absolute_file_name(fs8_file_name_utf8);
+
+  // the new partition is taken before the old one is released, reopening the same archive keeps its file open
+  Fs8Partition * newPartition = file_systems_container.tryReusePartition(fullName, memory_mapped);
+  if (!newPartition)
+  {
+    Fs8TimedLock lock(partitions_lock, nullptr);
+    newPartition = file_systems_container.findOrInitializePartitionFn(fullName.c_str(), memory_mapped);
+  }
+
+  if (partition)
+    file_systems_container.unusePartition(partition);
+  partition = newPartition;
+  return partition != nullptr;
+}
+
+bool Fs8FileSystem::initalizeFromMemory(void * data, int64_t size)
+{
+  cancel_prefetch_and_wait(this, prefetchTasks);
+
+  Fs8TimedLock lock(partitions_lock, nullptr);
+  if (partition)
+    file_systems_container.unusePartition(partition);
+  partition = file_systems_container.findOrInitializePartitionMem(data, size);
+  return partition != nullptr;
+}
+
+
+void Fs8FileSystem::getAllFileNames(vector<string> & out_file_names)
+{
+  out_file_names.clear();
+  if (!partition)
+    return;
+  shared_ptr<Fs8FileTable> table = partition->getFileTable();
+  table->getAllFileNames(out_file_names);
+}
+
+
+void Fs8FileSystem::getAllFileNamesInArchiveOrder(vector<string> & out_file_names)
+{
+  out_file_names.clear();
+  if (!partition)
+    return;
+  shared_ptr<Fs8FileTable> table = partition->getFileTable();
+  table->getAllFileNamesInArchiveOrder(out_file_names);
+}
+
+
+Fs8FileName::Fs8FileName(std::string_view file_name) :
+  name(file_name)
+{
+  normalize_file_name(name);
+  nameHash = hash_file_name(name.c_str(), name.length());
+}
+
+
+static bool file_exists(Fs8Partition * partition, const Fs8NameRef & name)
+{
+  if (!partition)
+    return false;
+  partition->touch();
+  Fs8PinnedState state = partition->pinState();
+  Fs8FileInfo info;
+  return state->fileTable->find(name, info);
+}
+
+bool Fs8FileSystem::fileExists(const char * file_name)
+{
+  return file_name ? fileExists(std::string_view(file_name)) : false;
+}
+
+bool Fs8FileSystem::fileExists(std::string_view file_name)
+{
+  return file_exists(partition, name_ref(file_name));
+}
+
+bool Fs8FileSystem::fileExists(const Fs8FileName & file_name)
+{
+  return file_exists(partition, name_ref(file_name));
+}
+
+
+static int64_t partition_file_size(Fs8Partition * partition, const Fs8NameRef & name)
+{
+  if (!partition)
+    return 0;
+  partition->touch();
+  Fs8PinnedState state = partition->pinState();
+  Fs8FileInfo info;
+  if (state->fileTable->find(name, info))
+    return info.decompressedSize;
+  else
+    return 0;
+}
+
+int64_t Fs8FileSystem::getFileSize(const char * file_name)
+{
+  return file_name ? getFileSize(std::string_view(file_name)) : 0;
+}
+
+int64_t Fs8FileSystem::getFileSize(std::string_view file_name)
+{
+  return partition_file_size(partition, name_ref(file_name));
+}
+
+int64_t Fs8FileSystem::getFileSize(const Fs8FileName & file_name)
+{
+  return partition_file_size(partition, name_ref(file_name));
+}
+
+
+// Bytes [offset, offset + size) of the entry as it is in the archive, points into memory for in-memory
+// and mapped partitions, otherwise they are read into 'storage'.
+static const char * get_entry_bytes(Fs8Partition * partition, const Fs8FileInfo & info, const shared_ptr<Fs8ArchiveFile> & file,
+  int64_t offset, int64_t size, vector<char> & storage)
+{
+  if (offset < 0 || size < 0 || offset + size > info.compressedSize || info.offsetInFile < 24)
+  {
+    Fs8FileSystem::errorLogCallback("Invalid file postion");
+    return nullptr;
+  }
+
+  if (partition->isInMemory || (file && file->mappedDataPtr))
+  {
+    int64_t dataSize = partition->isInMemory ? partition->inMemorySize : file->mappedSize;
+    if (dataSize > 0 && info.offsetInFile + info.compressedSize > dataSize)
+    {
+      Fs8FileSystem::errorLogCallback("Invalid file postion");
+      return nullptr;
+    }
+    return (partition->isInMemory ? partition->inMemoryDataPtr : file->mappedDataPtr) + info.offsetInFile + offset;
+  }
+
+  if (!file)
+  {
+    Fs8FileSystem::errorLogCallback("partition file is closed");
+    return nullptr;
+  }
+
+  storage.resize(size_t(max(size, int64_t(1))));
+  if (!file->readAt(info.offsetInFile + offset, &storage[0], size_t(size)))
+  {
+    Fs8FileSystem::errorLogCallback("Cannot read from file");
+    return nullptr;
+  }
+  return &storage[0];
+}
+
+
+// Decompressed solid block of an FS8_ENTRY_IN_BLOCK entry. Blocks are cached by their offset regardless
+// of keepInMemoryThreshold (unless caching is off), so the neighbours of a file are served from memory.
+static Fs8CachedBytes read_block(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file, const char * compressed = nullptr)
+{
+  Fs8CachedBytes block = decompressed_cache.find(&table->cache, info.offsetInFile);
+  if (!block)
+  {
+    vector<char> storage;
+    if (!compressed)
+      compressed = get_entry_bytes(partition, info, file, 0, info.compressedSize, storage);
+    if (!compressed)
+      return nullptr;
+
+    unsigned long long blockSize = ZSTD_getFrameContentSize(compressed, size_t(info.compressedSize));
+    if (blockSize == ZSTD_CONTENTSIZE_UNKNOWN || blockSize == ZSTD_CONTENTSIZE_ERROR || blockSize > FS_MAX_FILE_SIZE)
+    {
+      Fs8FileSystem::errorLogCallback("Corrupted file (invalid block size)");
+      return nullptr;
+    }
+
+    shared_ptr<vector<char>> decompressed = make_shared<vector<char>>(size_t(blockSize));
+    size_t res = decompress_frames(table, decompressed->data(), decompressed->size(), compressed, size_t(info.compressedSize));
+    if (ZSTD_isError(res) || res != decompressed->size())
+    {
+      Fs8FileSystem::errorLogCallback((string("ZSTD decompression error: ") +
+        (ZSTD_isError(res) ? ZSTD_getErrorName(res) : "invalid block size")).c_str());
+      return nullptr;
+    }
+
+    block = decompressed;
+    if (decompressed_cache.isEnabled())
+      decompressed_cache.insert(&table->cache, info.offsetInFile, block);
+  }
+
+  if (info.offsetInBlock < 0 || info.decompressedSize < 0 || info.offsetInBlock > int64_t(block->size()) - info.decompressedSize)
+  {
+    Fs8FileSystem::errorLogCallback("Invalid file postion");
+    return nullptr;
+  }
+
+  return block;
+}
+
+
+// Decompresses one entry piece by piece. Compressed bytes are taken straight from memory (in-memory or mapped
+// partition) or read with FS_PREAD in ZSTD_DStreamInSize() chunks, memory use does not depend on the file size.
+struct Fs8EntryStream
+{
+  shared_ptr<Fs8FileTable> table; // set by Fs8FileReader, keeps the partition state alive
+  shared_ptr<Fs8ArchiveFile> file;
+  Fs8FileInfo info;
+  const char * data = nullptr;    // compressed entry, when the archive is in memory
+  Fs8CachedBytes block;           // decompressed solid block of an FS8_ENTRY_IN_BLOCK entry
+  ZSTD_DStream * dstream = nullptr;
+  vector<char> inBuf;
+  ZSTD_inBuffer input = { nullptr, 0, 0 };
+  int64_t compressedPos = 0;      // compressed bytes taken from the archive
+  int64_t position = 0;           // decompressed bytes returned
+  Fs8Partition * partition = nullptr;
+  bool verify = false;            // verify-on-read of Fs8FileReader, the hash is checked at the end of the file
+  Fs8ContentHasher hasher;
+
+  ~Fs8EntryStream()
+  {
+    if (dstream)
+      ZSTD_freeDStream(dstream);
+  }
+
+  bool init(Fs8Partition * partition_, Fs8FileTable * table_, const shared_ptr<Fs8ArchiveFile> & file_,
+    const Fs8FileInfo & info_)
+  {
+    partition = partition_;
+    file = file_;
+    info = info_;
+
+    if (info.decompressedSize < 0 || info.compressedSize < 0 || info.offsetInFile < 24 ||
+      (info.isStored() && info.compressedSize != info.decompressedSize))
+    {
+      Fs8FileSystem::errorLogCallback("Invalid file postion");
+      return false;
+    }
+
+    if (info.isInBlock())
+    {
+      block = read_block(partition, table_, info, file);
+      data = block ? block->data() + info.offsetInBlock : nullptr;
+      return block != nullptr;
+    }
+
+    if (partition->isInMemory || (file && file->mappedDataPtr))
+    {
+      const char * dataPtr = partition->isInMemory ? partition->inMemoryDataPtr : file->mappedDataPtr;
+      int64_t dataSize = partition->isInMemory ? partition->inMemorySize : file->mappedSize;
+      if (dataSize > 0 && info.offsetInFile + info.compressedSize > dataSize)
+      {
+        Fs8FileSystem::errorLogCallback("Invalid file postion");
+        return false;
+      }
+      data = dataPtr + info.offsetInFile;
+    }
+    else if (!file)
+    {
+      Fs8FileSystem::errorLogCallback("partition file is closed");
+      return false;
+    }
+
+    if (info.isStored() || info.decompressedSize == 0)
+      return true;
+
+    dstream = ZSTD_createDStream();
+    if (!dstream || ZSTD_isError(ZSTD_initDStream(dstream)))
+    {
+      Fs8FileSystem::errorLogCallback("Cannot create ZSTD stream");
+      return false;
+    }
+
+    char frameHeader[18] = { 0 }; // ZSTD_FRAMEHEADERSIZE_MAX
+    size_t frameHeaderSize = size_t(min(int64_t(sizeof(frameHeader)), info.compressedSize));
+    if (data)
+      memcpy(frameHeader, data, frameHeaderSize);
+    else if (!file->readAt(info.offsetInFile, frameHeader, frameHeaderSize))
+    {
+      Fs8FileSystem::errorLogCallback("Cannot read from file");
+      return false;
+    }
+
+    if (const ZSTD_DDict * ddict = table_->findDictionary(ZSTD_getDictID_fromFrame(frameHeader, frameHeaderSize)))
+      ZSTD_DCtx_refDDict(dstream, ddict);
+
+    if (data)
+    {
+      input = { data, size_t(info.compressedSize), 0 };
+      compressedPos = info.compressedSize;
+    }
+    else
+      inBuf.resize(ZSTD_DStreamInSize());
+
+    return true;
+  }
+
+  int64_t read(void * buffer, int64_t size)
+  {
+    size = min(size, info.decompressedSize - position);
+    if (size <= 0)
+      return 0;
+
+    if (info.isStored() || info.isInBlock())
+    {
+      if (data)
+        memcpy(buffer, data + position, size_t(size));
+      else if (!file->readAt(info.offsetInFile + position, buffer, size_t(size)))
+      {
+        Fs8FileSystem::errorLogCallback("Cannot read from file");
+        return -1;
+      }
+      position += size;
+      return size;
+    }
+
+    ZSTD_outBuffer output = { buffer, size_t(size), 0 };
+    while (output.pos < output.size)
+    {
+      if (input.pos == input.size && compressedPos < info.compressedSize)
+      {
+        size_t chunk = size_t(min(int64_t(inBuf.size()), info.compressedSize - compressedPos));
+        if (!file->readAt(info.offsetInFile + compressedPos, &inBuf[0], chunk))
+        {
+          Fs8FileSystem::errorLogCallback("Cannot read from file");
+          return -1;
+        }
+        input = { &inBuf[0], chunk, 0 };
+        compressedPos += int64_t(chunk);
+      }
+
+      size_t prevInPos = input.pos;
+      size_t prevOutPos = output.pos;
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      size_t res = ZSTD_decompressStream(dstream, &output, &input);
+      add_stat(&partition->stats, &Fs8StatCounters::decompressNsec, nsec_since(start));
+      add_stat(&partition->stats, &Fs8StatCounters::bytesDecompressed, int64_t(output.pos - prevOutPos));
+      if (ZSTD_isError(res))
+      {
+        Fs8FileSystem::errorLogCallback((string("ZSTD decompression error: ") + ZSTD_getErrorName(res)).c_str());
+        return -1;
+      }
+
+      if (input.pos == prevInPos && output.pos == prevOutPos)
+      {
+        Fs8FileSystem::errorLogCallback("ZSTD decompression error: unexpected end of compressed data");
+        return -1;
+      }
+    }
+
+    position += int64_t(output.pos);
+    return int64_t(output.pos);
+  }
+};
+
+
+// verify-on-read: the first read of an entry checks the decompressed bytes against its content hash,
+// entries without a hash (older archives) are not checked
+static bool needs_verification(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info)
+{
+  return partition->verifyOnRead.load(memory_order_relaxed) && info.contentHash != 0 && info.entryIndex >= 0 &&
+    info.entryIndex < int64_t(table->index.size()) && !table->isVerified(info.entryIndex);
+}
+
+static bool check_content_hash(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info, uint64_t hash)
+{
+  if (hash != info.contentHash)
+  {
+    const char * name = "";
+    size_t length = 0;
+    table->index.entryName(size_t(info.entryIndex), name, length);
+    Fs8FileSystem::errorLogCallback((string("Checksum mismatch: ") + string(name, length) + " in " +
+      (partition->isInMemory ? string("in-memory archive") : partition->fileName)).c_str());
+    return false;
+  }
+
+  table->setVerified(info.entryIndex);
+  return true;
+}
+
+static bool verify_entry(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info, const void * bytes)
+{
+  return !needs_verification(partition, table, info) ||
+    check_content_hash(partition, table, info, hash_content(bytes, size_t(info.decompressedSize)));
+}
+
+
+// Called without any lock held, 'file' keeps the archive open while we are reading.
+// 'compressed' - the entry bytes if the caller has already read them (getFilesBytes)
+static bool decompress_file_bytes(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file, void * to_buffer, const char * compressed = nullptr)
+{
+  if (info.decompressedSize < 0 || info.compressedSize < 0 || info.offsetInFile < 24)
+  {
+    Fs8FileSystem::errorLogCallback("Invalid file postion");
+    return false;
+  }
+
+  if (info.decompressedSize == 0)
+    return true;
+
+  // large files are not read into a temporary buffer at once
+  if (!compressed && !info.isStored() && !partition->isInMemory && file && !file->mappedDataPtr && info.compressedSize > FS_STREAM_THRESHOLD)
+  {
+    Fs8EntryStream stream;
+    return stream.init(partition, table, file, info) &&
+      stream.read(to_buffer, info.decompressedSize) == info.decompressedSize;
+  }
+
+  if (!compressed && info.isStored() && !partition->isInMemory && file && !file->mappedDataPtr)
+  {
+    if (!file->readAt(info.offsetInFile, to_buffer, info.decompressedSize))
+    {
+      Fs8FileSystem::errorLogCallback("Cannot read from file");
+      return false;
+    }
+    return true;
+  }
+
+  const char * dataPtr = compressed;
+  vector<char> compressedData;
+
+  if (!compressed && (partition->isInMemory || (file && file->mappedDataPtr)))
+  {
+    dataPtr = partition->isInMemory ? partition->inMemoryDataPtr : file->mappedDataPtr;
+    int64_t dataSize = partition->isInMemory ? partition->inMemorySize : file->mappedSize;
+
+    if (dataSize > 0 && info.offsetInFile + info.compressedSize > dataSize)
+    {
+      Fs8FileSystem::errorLogCallback(partition->isInMemory ? "Internal error (invalid partition->inMemorySize)" :
+        "Internal error (invalid mapped file size)");
+      return false;
+    }
+
+    dataPtr += info.offsetInFile;
+  }
+  else if (!compressed)
+  {
+    if (!file)
+    {
+      Fs8FileSystem::errorLogCallback("partition file is closed");
+      return false;
+    }
+
+    compressedData.resize(info.compressedSize);
+    if (!file->readAt(info.offsetInFile, &compressedData[0], info.compressedSize))
+    {
+      Fs8FileSystem::errorLogCallback("Cannot read from file");
+      return false;
+    }
+
+    dataPtr = &compressedData[0];
+  }
+
+  if (info.isStored())
+  {
+    memcpy(to_buffer, dataPtr, info.decompressedSize);
+    return true;
+  }
+
+  size_t res = decompress_frames(table, to_buffer, info.decompressedSize, dataPtr, info.compressedSize);
+
+  if (ZSTD_isError(res))
+  {
+    Fs8FileSystem::errorLogCallback((string("ZSTD decompression error: ") + ZSTD_getErrorName(res)).c_str());
+    return false;
+  }
+
+  return true;
+}
+
+
+// stored files of in-memory and mapped partitions are already in memory, caching them would just duplicate them
+static bool is_directly_addressable(Fs8Partition * partition, const Fs8FileInfo & info, const shared_ptr<Fs8ArchiveFile> & file)
+{
+  return info.isStored() && (partition->isInMemory || (file && file->mappedDataPtr));
+}
+
+
+// Several threads may decompress the same small file at once, the first one publishes its copy.
+static bool read_file_bytes(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file, void * to_buffer, const char * compressed = nullptr)
+{
+  if (info.isInBlock())
+  {
+    Fs8CachedBytes block = read_block(partition, table, info, file, compressed);
+    if (block)
+      memcpy(to_buffer, block->data() + info.offsetInBlock, size_t(info.decompressedSize));
+    return block != nullptr && verify_entry(partition, table, info, to_buffer);
+  }
+
+  bool cacheable = info.decompressedSize > 0 && decompressed_cache.isCacheable(info.decompressedSize) &&
+    !is_directly_addressable(partition, info, file);
+  if (cacheable)
+    if (Fs8CachedBytes cached = decompressed_cache.find(&table->cache, info.offsetInFile))
+    {
+      memcpy(to_buffer, cached->data(), info.decompressedSize);
+      return verify_entry(partition, table, info, to_buffer);
+    }
+
+  if (!decompress_file_bytes(partition, table, info, file, to_buffer, compressed) ||
+    !verify_entry(partition, table, info, to_buffer))
+    return false;
+
+  if (cacheable)
+    decompressed_cache.insert(&table->cache, info.offsetInFile,
+      make_shared<const vector<char>>((const char *)to_buffer, (const char *)to_buffer + info.decompressedSize));
+
+  return true;
+}
+
+
+static bool read_file_view(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file, Fs8FileView & out_view)
+{
+  out_view = Fs8FileView();
+  if (info.decompressedSize == 0)
+    return true;
+
+  if (info.isInBlock())
+  {
+    Fs8CachedBytes block = read_block(partition, table, info, file);
+    if (!block)
+      return false;
+    out_view.bytes = block->data() + info.offsetInBlock;
+    out_view.size = info.decompressedSize;
+    out_view.holder = block;
+    return true;
+  }
+
+  if (is_directly_addressable(partition, info, file))
+  {
+    int64_t dataSize = partition->isInMemory ? partition->inMemorySize : file->mappedSize;
+    if (info.offsetInFile < 24 || (dataSize > 0 && info.offsetInFile + info.decompressedSize > dataSize))
+    {
+      Fs8FileSystem::errorLogCallback("Invalid file postion");
+      return false;
+    }
+
+    if (partition->isInMemory)
+    {
+      out_view.bytes = partition->inMemoryDataPtr + info.offsetInFile;
+      out_view.holder = shared_ptr<const void>(partition->inMemoryDataPtr, [](const void *) {}); // owned by the caller of initalizeFromMemory
+    }
+    else
+    {
+      out_view.bytes = file->mappedDataPtr + info.offsetInFile;
+      out_view.holder = file;
+    }
+    out_view.size = info.decompressedSize;
+    return true;
+  }
+
+  bool cacheable = decompressed_cache.isCacheable(info.decompressedSize);
+  Fs8CachedBytes bytes = cacheable ? decompressed_cache.find(&table->cache, info.offsetInFile) : nullptr;
+
+  if (!bytes)
+  {
+    if (info.decompressedSize < 0 || info.decompressedSize > FS_MAX_FILE_SIZE)
+    {
+      Fs8FileSystem::errorLogCallback("Invalid file size");
+      return false;
+    }
+
+    shared_ptr<vector<char>> decompressed = make_shared<vector<char>>(size_t(info.decompressedSize));
+    if (!decompress_file_bytes(partition, table, info, file, decompressed->data()))
+      return false;
+
+    bytes = decompressed;
+    if (cacheable)
+      decompressed_cache.insert(&table->cache, info.offsetInFile, bytes);
+  }
+
+  out_view.bytes = bytes->data();
+  out_view.size = int64_t(bytes->size());
+  out_view.holder = bytes;
+  return true;
+}
+
+
+// Decompresses only the chunks covering the range, decompressed chunks are cached by the offset of their frame.
+static bool read_chunked_range(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file, int64_t offset, int64_t length, char * to_buffer)
+{
+  vector<char> storage;
+  const char * tablePtr = get_entry_bytes(partition, info, file, 0, sizeof(Fs8ChunkTable), storage);
+  if (!tablePtr)
+    return false;
+
+  Fs8ChunkTable chunkTable;
+  memcpy(&chunkTable, tablePtr, sizeof(chunkTable));
+  int64_t chunkSize = int64_t(chunkTable.chunkSize);
+  if (chunkTable.skippableMagic != ZSTD_MAGIC_SKIPPABLE_START || chunkTable.magic != FS_CHUNK_TABLE_MAGIC ||
+    get_chunk_count(info.decompressedSize, chunkSize) != int64_t(chunkTable.chunkCount) ||
+    int64_t(chunkTable.frameSize) + 8 != chunk_table_size(chunkTable.chunkCount))
+  {
+    Fs8FileSystem::errorLogCallback("Corrupted file (invalid chunk table)");
+    return false;
+  }
+
+  int64_t firstChunk = offset / chunkSize;
+  int64_t lastChunk = (offset + length - 1) / chunkSize;
+  const char * offsetsPtr = get_entry_bytes(partition, info, file, sizeof(Fs8ChunkTable) + firstChunk * sizeof(uint64_t),
+    (lastChunk - firstChunk + 2) * sizeof(uint64_t), storage);
+  if (!offsetsPtr)
+    return false;
+
+  vector<uint64_t> frameOffsets(size_t(lastChunk - firstChunk + 2));
+  memcpy(&frameOffsets[0], offsetsPtr, frameOffsets.size() * sizeof(uint64_t));
+
+  for (int64_t chunk = firstChunk; chunk <= lastChunk; chunk++)
+  {
+    int64_t frameBegin = int64_t(frameOffsets[size_t(chunk - firstChunk)]);
+    int64_t frameEnd = int64_t(frameOffsets[size_t(chunk - firstChunk + 1)]);
+    if (frameBegin < chunk_table_size(chunkTable.chunkCount) || frameEnd <= frameBegin || frameEnd > info.compressedSize)
+    {
+      Fs8FileSystem::errorLogCallback("Corrupted file (invalid chunk table)");
+      return false;
+    }
+
+    int64_t chunkBegin = chunk * chunkSize;
+    int64_t chunkLength = min(chunkSize, info.decompressedSize - chunkBegin);
+    int64_t copyBegin = max(offset, chunkBegin);
+    int64_t copyLength = min(offset + length, chunkBegin + chunkLength) - copyBegin;
+    char * dst = to_buffer + (copyBegin - offset);
+
+    int64_t cacheKey = info.offsetInFile + frameBegin;
+    bool cacheable = decompressed_cache.isCacheable(chunkLength);
+    if (cacheable)
+      if (Fs8CachedBytes cached = decompressed_cache.find(&table->cache, cacheKey))
       {
-        lock_guard<recursive_mutex> lock(partitions_lock);
-        uint64_t curFileTime = get_file_time(partition->fileName.c_str());
-        if (partition->fileTime != curFileTime)
-        {
-          fclose(partition->fileDescriptor);
-          partition->fileDescriptor = nullptr;
-        }
+        memcpy(dst, cached->data() + (copyBegin - chunkBegin), size_t(copyLength));
+        continue;
       }
+
+    const char * frame = get_entry_bytes(partition, info, file, frameBegin, frameEnd - frameBegin, storage);
+    if (!frame)
+      return false;
+
+    bool whole = copyLength == chunkLength && !cacheable;
+    shared_ptr<vector<char>> decompressed = whole ? nullptr : make_shared<vector<char>>(size_t(chunkLength));
+    size_t res = decompress_frames(table, whole ? dst : decompressed->data(), size_t(chunkLength),
+      frame, size_t(frameEnd - frameBegin));
+
+    if (ZSTD_isError(res) || res != size_t(chunkLength))
+    {
+      Fs8FileSystem::errorLogCallback((string("ZSTD decompression error: ") +
+        (ZSTD_isError(res) ? ZSTD_getErrorName(res) : "invalid chunk size")).c_str());
+      return false;
+    }
+
+    if (!whole)
+    {
+      memcpy(dst, decompressed->data() + (copyBegin - chunkBegin), size_t(copyLength));
+      if (cacheable)
+        decompressed_cache.insert(&table->cache, cacheKey, decompressed);
+    }
+  }
+
+  return true;
+}
+
+
+static bool read_file_range(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file, int64_t offset, int64_t length, char * to_buffer)
+{
+  if (length == 0)
+    return true;
+
+  if (info.isInBlock())
+  {
+    Fs8CachedBytes block = read_block(partition, table, info, file);
+    if (block)
+      memcpy(to_buffer, block->data() + info.offsetInBlock + offset, size_t(length));
+    return block != nullptr;
+  }
+
+  if (info.isStored())
+  {
+    if (!partition->isInMemory && file && !file->mappedDataPtr)
+    {
+      if (info.offsetInFile < 24 || !file->readAt(info.offsetInFile + offset, to_buffer, size_t(length)))
+      {
+        Fs8FileSystem::errorLogCallback("Cannot read from file");
+        return false;
+      }
+      return true;
+    }
+
+    vector<char> storage;
+    const char * bytes = get_entry_bytes(partition, info, file, offset, length, storage);
+    if (bytes)
+      memcpy(to_buffer, bytes, size_t(length));
+    return bytes != nullptr;
+  }
+
+  if (info.isChunked())
+    return read_chunked_range(partition, table, info, file, offset, length, to_buffer);
+
+  // one zstd frame, small files are taken from the cache, large ones are decompressed up to the end of the range
+  if (decompressed_cache.isCacheable(info.decompressedSize))
+  {
+    Fs8FileView view;
+    if (!read_file_view(partition, table, info, file, view) || !verify_entry(partition, table, info, view.bytes))
+      return false;
+    memcpy(to_buffer, view.bytes + offset, size_t(length));
+    return true;
+  }
+
+  Fs8EntryStream stream;
+  if (!stream.init(partition, table, file, info))
+    return false;
+
+  vector<char> skipBuffer(size_t(min(offset, int64_t(ZSTD_DStreamOutSize()))));
+  while (stream.position < offset)
+    if (stream.read(&skipBuffer[0], min(offset - stream.position, int64_t(skipBuffer.size()))) <= 0)
+      return false;
+
+  return stream.read(to_buffer, length) == length;
+}
+
+
+static bool get_file_bytes(Fs8Partition * partition, const Fs8NameRef & name, void * to_buffer, int64_t buffer_size)
+{
+  if (to_buffer == 0)
+    return false;
+
+  if (!partition)
+  {
+    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
+    return false;
+  }
+
+  partition->touch();
+
+  Fs8PinnedState state = partition->pinState();
+
+  Fs8FileInfo info;
+  if (!state->fileTable->find(name, info) || info.decompressedSize > buffer_size)
+    return false;
+
+  return read_file_bytes(partition, state->fileTable.get(), info, state->archiveFile, to_buffer);
+}
+
+bool Fs8FileSystem::getFileBytes(const char * file_name, void * to_buffer, int64_t buffer_size)
+{
+  return file_name ? getFileBytes(std::string_view(file_name), to_buffer, buffer_size) : false;
+}
+
+bool Fs8FileSystem::getFileBytes(std::string_view file_name, void * to_buffer, int64_t buffer_size)
+{
+  return get_file_bytes(partition, name_ref(file_name), to_buffer, buffer_size);
+}
+
+bool Fs8FileSystem::getFileBytes(const Fs8FileName & file_name, void * to_buffer, int64_t buffer_size)
+{
+  return get_file_bytes(partition, name_ref(file_name), to_buffer, buffer_size);
+}
+
+
+// 'found' - whether the file is in the table, a missing file gives empty bytes and true as before
+static bool read_file_bytes_to_vector(Fs8Partition * partition, Fs8FileTable * table, bool found, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  int64_t fileSize = found ? info.decompressedSize : 0;
+
+  if (fileSize > FS_MAX_FILE_SIZE)
+  {
+    Fs8FileSystem::errorLogCallback("File is too large");
+    return false;
+  }
+
+  if (fileSize < 0)
+  {
+    Fs8FileSystem::errorLogCallback("Invalid file size");
+    return false;
+  }
+
+  if (addFinalZero)
+  {
+    out_file_bytes.resize(fileSize + 1);
+    out_file_bytes.back() = 0;
+  }
+  else
+  {
+    out_file_bytes.resize(fileSize);
+  }
+  bool res = fileSize ? read_file_bytes(partition, table, info, file, &out_file_bytes[0]) : true;
+  if (!res)
+    out_file_bytes.clear();
+  return res;
+}
+
+
+static bool get_file_bytes(Fs8Partition * partition, const Fs8NameRef & name, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  if (!partition)
+  {
+    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
+    return false;
+  }
+
+  partition->touch();
+
+  Fs8PinnedState state = partition->pinState();
+
+  Fs8FileInfo info;
+  bool found = state->fileTable->find(name, info);
+  return read_file_bytes_to_vector(partition, state->fileTable.get(), found, info, state->archiveFile, out_file_bytes,
+    addFinalZero);
+}
+
+bool Fs8FileSystem::getFileBytes(const char * file_name, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  return file_name ? getFileBytes(std::string_view(file_name), out_file_bytes, addFinalZero) : false;
+}
+
+bool Fs8FileSystem::getFileBytes(std::string_view file_name, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  return get_file_bytes(partition, name_ref(file_name), out_file_bytes, addFinalZero);
+}
+
+bool Fs8FileSystem::getFileBytes(const Fs8FileName & file_name, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  return get_file_bytes(partition, name_ref(file_name), out_file_bytes, addFinalZero);
+}
+
+Fs8FileReader::Fs8FileReader()
+{
+}
+
+
+Fs8FileReader::~Fs8FileReader()
+{
+  close();
+}
+
+
+bool Fs8FileReader::open(Fs8FileSystem & fs, const char * file_name)
+{
+  close();
+
+  if (!fs.partition)
+  {
+    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
+    return false;
+  }
+
+  if (!file_name)
+    return false;
+
+  fs.partition->touch();
+
+  shared_ptr<Fs8FileTable> table;
+  shared_ptr<Fs8ArchiveFile> file;
+  fs.partition->getState(table, file);
+
+  Fs8FileInfo info;
+  if (!table->find(name_ref(file_name), info))
+    return false;
+
+  stream = new Fs8EntryStream;
+  stream->table = table;
+  if (!stream->init(fs.partition, table.get(), file, info))
+  {
+    close();
+    return false;
+  }
+
+  stream->verify = needs_verification(fs.partition, table.get(), info);
+
+  return true;
+}
+
+
+void Fs8FileReader::close()
+{
+  delete stream;
+  stream = nullptr;
+}
+
+
+int64_t Fs8FileReader::read(void * buffer, int64_t size)
+{
+  if (!stream || size < 0 || (!buffer && size > 0))
+    return -1;
+
+  int64_t readBytes = stream->read(buffer, size);
+  if (stream->verify && readBytes > 0)
+  {
+    stream->hasher.update(buffer, size_t(readBytes));
+    if (stream->position == stream->info.decompressedSize)
+    {
+      stream->verify = false;
+      if (!check_content_hash(stream->partition, stream->table.get(), stream->info, stream->hasher.digest()))
+        return -1;
     }
   }
+  return readBytes;
+}
 
 
-  chrono::time_point<chrono::steady_clock> msecRef;
+int64_t Fs8FileReader::size() const
+{
+  return stream ? stream->info.decompressedSize : 0;
+}
 
-  void act()
-  {
-    auto now = chrono::steady_clock::now();
-    auto elapsedTime = now - msecRef;
-    int64_t dt = abs(chrono::duration_cast<chrono::milliseconds>(elapsedTime).count());
-    if (dt > 100)
-    {
-      msecRef = now;
-      lock_guard<recursive_mutex> lock(partitions_lock);
-      bool hasFileDescriptors = false;
 
-      for (auto & p : partitions)
-        if (p->fileDescriptor)
-        {
-          PartitionsContainer::checkPartionFileTime(p);
-          if (p->fileDescriptor)
-            hasFileDescriptors = true;
-        }
-    }
-  }
+int64_t Fs8FileReader::position() const
+{
+  return stream ? stream->position : 0;
+}
 
-} file_systems_container;
 
+void Fs8FileSystem::setCacheSettings(const Fs8CacheSettings & settings)
+{
+  decompressed_cache.setSettings(settings);
+}
 
-static void normalize_file_name(string & name)
+Fs8CacheSettings Fs8FileSystem::getCacheSettings()
 {
-  for (char & ch : name)
+  return decompressed_cache.getSettings();
+}
+
+void Fs8FileSystem::clearCache()
+{
+  decompressed_cache.clear();
+}
+
+void Fs8FileSystem::setCacheLimit(int64_t max_bytes)
+{
+  if (!partition)
+    return;
+  shared_ptr<Fs8FileTable> table;
   {
-    ch = tolower(ch);
-    if (ch == '\\')
-      ch = '/';
+    lock_guard<recursive_mutex> lock(partition->decompression_lock);
+    partition->cacheLimit = max_bytes < 0 ? -1 : max_bytes;
+    table = partition->getFileTable();
   }
+  decompressed_cache.setTableLimit(&table->cache, max_bytes < 0 ? -1 : max_bytes);
 }
 
 
-void Fs8FileSystem::act()
+void Fs8FileSystem::setVerifyOnRead(bool verify)
 {
-  file_systems_container.act();
+  if (partition)
+    partition->verifyOnRead.store(verify, memory_order_relaxed);
 }
 
 
-Fs8FileSystem::Fs8FileSystem()
+Fs8Stats Fs8FileSystem::getStats()
 {
+  if (!partition)
+    return Fs8Stats();
+  Fs8Stats stats = partition->stats.snapshot();
+  shared_ptr<Fs8FileTable> table = partition->getFileTable();
+  stats.cacheResidentBytes = decompressed_cache.residentBytes(&table->cache);
+  return stats;
 }
 
-bool Fs8FileSystem::checkFs8FileSystemSignatures(const char * fs8_file_name_utf8)
+void Fs8FileSystem::resetStats()
 {
-  vector<char> data(65536 * 2);
-  FILE * f = FS_FOPEN(fs8_file_name_utf8, "rb");
-  if (!f)
-    return false;
+  if (partition)
+    partition->stats.reset();
+}
 
-  if (fread(&data[0], 32, 1, f) != 1)
+Fs8Stats Fs8FileSystem::getGlobalStats()
+{
+  Fs8Stats stats = global_stats.snapshot();
+  stats.cacheResidentBytes = decompressed_cache.residentBytes(nullptr);
+  return stats;
+}
+
+void Fs8FileSystem::resetGlobalStats()
+{
+  global_stats.reset();
+}
+
+
+static bool get_file_view(Fs8Partition * partition, const Fs8NameRef & name, Fs8FileView & out_view)
+{
+  out_view = Fs8FileView();
+
+  if (!partition)
   {
-    fclose(f);
+    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
     return false;
   }
 
-  fread(&data[0], 32, 1, f);
-  int64_t pos = check_header_get_sign_offset(&data[0]);
+  partition->touch();
 
-  if (pos <= 0)
+  Fs8PinnedState state = partition->pinState();
+  Fs8FileTable * table = state->fileTable.get();
+
+  Fs8FileInfo info;
+  if (!table->find(name, info))
+    return false;
+
+  if (!read_file_view(partition, table, info, state->archiveFile, out_view) ||
+    !verify_entry(partition, table, info, out_view.bytes))
   {
-    fclose(f);
+    out_view = Fs8FileView();
     return false;
   }
+  return true;
+}
 
-  FS_FSEEK(f, pos, SEEK_SET);
-  struct
+bool Fs8FileSystem::getFileView(const char * file_name, Fs8FileView & out_view)
+{
+  if (!file_name)
   {
-    uint32_t size;
-    uint32_t type;
-    uint32_t hash;
-  } s;
+    out_view = Fs8FileView();
+    return false;
+  }
+  return getFileView(std::string_view(file_name), out_view);
+}
 
-  if (fread(&s, 8, 1, f) != 1)
+bool Fs8FileSystem::getFileView(std::string_view file_name, Fs8FileView & out_view)
+{
+  return get_file_view(partition, name_ref(file_name), out_view);
+}
+
+bool Fs8FileSystem::getFileView(const Fs8FileName & file_name, Fs8FileView & out_view)
+{
+  return get_file_view(partition, name_ref(file_name), out_view);
+}
+
+
+static bool get_file_range(Fs8Partition * partition, const Fs8NameRef & name, int64_t offset, int64_t length,
+  void * to_buffer)
+{
+  if (!partition)
   {
-    fclose(f);
+    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
     return false;
   }
 
-  if (s.type == 1 && fread(&s.hash, sizeof(s.hash), 1, f) == 1)
-  {
-    FS_FSEEK(f, 0, SEEK_SET);
-    size_t readBytes = 0;
-    uint32_t hash = 0;
-    int64_t p = pos;
-    while (p > 0 && (readBytes = fread(&data[0], 1, min(int64_t(data.size()), p), f)) > 0)
-    {
-      fhash_block((uint32_t *)&data[0], int(readBytes), hash);
-      p -= int(data.size());
-    }
+  if (!to_buffer && length > 0)
+    return false;
 
-    return hash == s.hash;
-  }
+  partition->touch();
 
-  return false;
+  Fs8PinnedState state = partition->pinState();
+
+  Fs8FileInfo info;
+  if (!state->fileTable->find(name, info) || offset < 0 || length < 0 || offset > info.decompressedSize - length)
+    return false;
+
+  return read_file_range(partition, state->fileTable.get(), info, state->archiveFile, offset, length, (char *)to_buffer);
+}
+
+bool Fs8FileSystem::getFileRange(const char * file_name, int64_t offset, int64_t length, void * to_buffer)
+{
+  return file_name ? getFileRange(std::string_view(file_name), offset, length, to_buffer) : false;
 }
 
+bool Fs8FileSystem::getFileRange(std::string_view file_name, int64_t offset, int64_t length, void * to_buffer)
+{
+  return get_file_range(partition, name_ref(file_name), offset, length, to_buffer);
+}
 
-bool Fs8FileSystem::createFs8FromFiles(const char * dir_, const vector<string> & file_names,
-  const char * out_file_name_utf8_, int compression_level, bool write_as_hex32, vector<string> * ignore_list)
+bool Fs8FileSystem::getFileRange(const Fs8FileName & file_name, int64_t offset, int64_t length, void * to_buffer)
 {
-  vector<pair<string, string>> namePairs;
-  for (const auto & n : file_names)
-    namePairs.emplace_back(make_pair(n, string()));
-  return createFs8FromFiles(dir_, namePairs, out_file_name_utf8_, compression_level, write_as_hex32, ignore_list);
+  return get_file_range(partition, name_ref(file_name), offset, length, to_buffer);
 }
 
-static bool recurseve_find_files(string dir, vector<string> & res)
+
+// one blob of the archive (a file or a solid block) and the requested files that are in it
+struct Fs8BatchUnit
 {
-  if (!dir.empty() && dir.back() != '\\' && dir.back() != '/')
-    dir += "/";
+  Fs8FileInfo info;
+  vector<size_t> files;
+};
 
-  error_code errCode;
-  for (filesystem::recursive_directory_iterator dirEntry(string_to_wstring(dir), errCode), end; dirEntry != end; ++dirEntry)
-    if (dirEntry->is_regular_file())
+// units read with one FS_PREAD (none if they need no reading), then decompressed by one thread
+struct Fs8BatchGroup
+{
+  vector<size_t> units;
+  int64_t begin = 0;
+  int64_t end = 0;
+};
+
+bool Fs8FileSystem::getFilesBytes(const vector<string> & file_names, vector<vector<char>> & out_files_bytes, int threads)
+{
+  out_files_bytes.clear();
+  out_files_bytes.resize(file_names.size());
+
+  if (!partition)
+  {
+    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
+    return false;
+  }
+
+  partition->touch();
+
+  shared_ptr<Fs8FileTable> table;
+  shared_ptr<Fs8ArchiveFile> file;
+  partition->getState(table, file);
+
+  bool ok = true;
+  vector<Fs8FileInfo> infos(file_names.size());
+  unordered_map<int64_t, size_t> unitByOffset;
+  vector<Fs8BatchUnit> units;
+  for (size_t i = 0; i < file_names.size(); i++)
+  {
+    if (!table->find(name_ref(file_names[i]), infos[i]))
     {
-      string s = wstring_to_string(dirEntry->path().generic_wstring());
-      if (s.length() > dir.length())
-        res.push_back(string(s.c_str() + dir.length()));
+      ok = false;
+      continue;
     }
 
-  if (errCode.value() != 0)
-    Fs8FileSystem::errorLogCallback(errCode.message().c_str());
+    if (infos[i].decompressedSize < 0 || infos[i].decompressedSize > FS_MAX_FILE_SIZE)
+    {
+      Fs8FileSystem::errorLogCallback("File is too large");
+      ok = false;
+      continue;
+    }
 
-  return errCode.value() == 0;
-}
+    if (infos[i].decompressedSize == 0)
+      continue;
 
-static bool expand_file_masks(string dir, vector<pair<string, string>> & file_names)
-{
-  if (!dir.empty() && (dir.back() != '\\' && dir.back() != '/'))
-    dir += "/";
+    auto it = unitByOffset.find(infos[i].offsetInFile);
+    if (it == unitByOffset.end())
+    {
+      it = unitByOffset.emplace(infos[i].offsetInFile, units.size()).first;
+      units.push_back(Fs8BatchUnit());
+      units.back().info = infos[i];
+    }
+    units[it->second].files.push_back(i);
+  }
 
-  for (int i = (file_names.size()) - 1; i >= 0; i--)
+  sort(units.begin(), units.end(), [](const Fs8BatchUnit & a, const Fs8BatchUnit & b)
+    { return a.info.offsetInFile < b.info.offsetInFile; });
+
+  // in-memory and mapped archives need no reads, cached files and large files are read on their own
+  bool mergeReads = !partition->isInMemory && file && !file->mappedDataPtr;
+  vector<Fs8BatchGroup> groups;
+  for (size_t u = 0; u < units.size(); u++)
   {
-    pair<string, string> namePair = file_names[i];
-    string name = namePair.first;
-    string archiveName = namePair.second;
-    if (!name.empty() && name.back() == '*')
+    const Fs8FileInfo & info = units[u].info;
+    bool cached = (info.isInBlock() || decompressed_cache.isCacheable(info.decompressedSize)) &&
+      decompressed_cache.contains(&table->cache, info.offsetInFile);
+    bool needsRead = mergeReads && !cached && info.compressedSize > 0 && info.compressedSize <= FS_BATCH_MAX_READ &&
+      info.offsetInFile >= 24;
+
+    int64_t begin = info.offsetInFile;
+    int64_t end = info.offsetInFile + info.compressedSize;
+    if (needsRead && !groups.empty() && groups.back().end > groups.back().begin &&
+      begin >= groups.back().end && begin - groups.back().end <= FS_BATCH_MAX_GAP && end - groups.back().begin <= FS_BATCH_MAX_READ)
     {
-      name.pop_back();
-      if (!archiveName.empty() && archiveName.back() != '*')
+      groups.back().units.push_back(u);
+      groups.back().end = end;
+      continue;
+    }
+
+    Fs8BatchGroup group;
+    group.units.push_back(u);
+    if (needsRead)
+    {
+      group.begin = begin;
+      group.end = end;
+    }
+    groups.push_back(move(group));
+  }
+
+  atomic<size_t> nextGroup(0);
+  atomic<bool> allRead(true);
+  auto work = [&]()
+  {
+    vector<char> buffer;
+    for (size_t g = nextGroup++; g < groups.size(); g = nextGroup++)
+    {
+      const Fs8BatchGroup & group = groups[g];
+      bool groupRead = group.end > group.begin;
+      if (groupRead)
       {
-        Fs8FileSystem::errorLogCallback((string("Expected '*' at end of in-archive file name ") + archiveName).c_str());
-        return false;
+        buffer.resize(size_t(group.end - group.begin));
+        if (!file->readAt(group.begin, &buffer[0], buffer.size()))
+        {
+          Fs8FileSystem::errorLogCallback("Cannot read from file");
+          groupRead = false; // every file falls back to its own read
+        }
       }
-      if (!archiveName.empty() && archiveName.back() == '*')
-        archiveName.pop_back();
-      file_names.erase(file_names.begin() + i);
 
-      vector<string> found;
-      if (!recurseve_find_files(dir + name, found))
+      for (size_t u : group.units)
       {
-        Fs8FileSystem::errorLogCallback("recurseve_find_files() failed");
-        return false;
-      }
+        const Fs8BatchUnit & unit = units[u];
+        const char * compressed = groupRead ? &buffer[0] + (unit.info.offsetInFile - group.begin) : nullptr;
+        Fs8CachedBytes block = unit.info.isInBlock() ? read_block(partition, table.get(), unit.info, file, compressed) : nullptr;
 
-      if (archiveName.empty())
-        archiveName = name;
+        for (size_t k = 0; k < unit.files.size(); k++)
+        {
+          const Fs8FileInfo & info = infos[unit.files[k]];
+          vector<char> & out = out_files_bytes[unit.files[k]];
+          bool res = false;
+          if (info.isInBlock())
+          {
+            res = block && info.offsetInBlock >= 0 && info.offsetInBlock <= int64_t(block->size()) - info.decompressedSize;
+            if (res)
+              out.assign(block->data() + info.offsetInBlock, block->data() + info.offsetInBlock + info.decompressedSize);
+          }
+          else if (k > 0 && !out_files_bytes[unit.files[0]].empty())
+          {
+            out = out_files_bytes[unit.files[0]]; // same blob under several names
+            res = true;
+          }
+          else
+          {
+            out.resize(size_t(info.decompressedSize));
+            res = read_file_bytes(partition, table.get(), info, file, &out[0], compressed);
+          }
 
-      if (archiveName == "/" || archiveName == "./")
-        archiveName = "";
+          res = res && verify_entry(partition, table.get(), info, out.data());
 
-      for (auto & f : found)
-        file_names.push_back(make_pair(dir + name + f, archiveName + f));
+          if (!res)
+          {
+            out.clear();
+            allRead = false;
+          }
+        }
+      }
     }
-  }
-
-  return true;
-}
+  };
 
+  if (threads <= 0)
+    threads = int(thread::hardware_concurrency());
+  threads = max(1, min(threads, int(groups.size())));
 
-bool Fs8FileSystem::createFs8FromFiles(const char * dir_, const vector<pair<string, string>> & file_names_,
-  const char * out_file_name_utf8_, int compression_level, bool write_as_hex32, vector<string> * ignore_list)
-{
-  vector<pair<string, string>> file_names = file_names_;
-
-  string dir(dir_);
-  string out_file_name_utf8(out_file_name_utf8_);
+  vector<thread> workers;
+  for (int i = 1; i < threads; i++)
+    workers.emplace_back(work);
+  work();
+  for (auto & w : workers)
+    w.join();
 
-  if (!expand_file_masks(dir_, file_names))
-    return false;
+  return ok && allRead;
+}
 
-  FileInfosMap fs_file_infos;
 
-  if (!dir.empty() && (dir.back() == '\\' || dir.back() == '/'))
-    dir.pop_back();
+// Brings one entry closer to the reader, errors are ignored (the read will report them).
+static void prefetch_entry(Fs8Partition * partition, Fs8FileTable * table, const Fs8FileInfo & info,
+  const shared_ptr<Fs8ArchiveFile> & file)
+{
+  if (info.decompressedSize <= 0 || info.offsetInFile < 24)
+    return;
 
-  FILE * outf = FS_FOPEN(out_file_name_utf8.c_str(), "wb");
-  if (!outf)
+  if (info.isInBlock())
   {
-    Fs8FileSystem::errorLogCallback((string("Cannot open file for write ") + out_file_name_utf8).c_str());
-    return false;
+    read_block(partition, table, info, file);
+    return;
   }
 
-  // ID: 4,  ver: 4,  file_table_offet: 8,  sigrantures_offset: 8
-  const char * header = "FS8.1   ********XXXXXXXX";
-  if (fwrite(header, strlen(header), 1, outf) != 1)
+  if (decompressed_cache.isCacheable(info.decompressedSize) && !is_directly_addressable(partition, info, file))
   {
-    Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
-    fclose(outf);
-    FS_UNLINK(out_file_name_utf8.c_str());
-    return false;
+    Fs8FileView view;
+    read_file_view(partition, table, info, file, view);
+    return;
   }
 
-  for (auto & namePair : file_names)
+  if (partition->isInMemory || !file)
+    return;
+
+  if (file->mappedDataPtr)
   {
-    string name = namePair.first;
-    string archiveName = namePair.second.empty() ? name : namePair.second;
+    // touch every page of the mapping
+    volatile char sink = 0;
+    for (int64_t pos = 0; pos < info.compressedSize && info.offsetInFile + pos < file->mappedSize; pos += 4096)
+      sink = sink + file->mappedDataPtr[info.offsetInFile + pos];
+    return;
+  }
 
-    for (auto & ch : name)
-      if (ch == '\\')
-        ch = '/';
+  vector<char> buffer(size_t(min(info.compressedSize, int64_t(1 << 20))));
+  for (int64_t pos = 0; pos < info.compressedSize; pos += int64_t(buffer.size()))
+    if (!file->readAt(info.offsetInFile + pos, &buffer[0], size_t(min(int64_t(buffer.size()), info.compressedSize - pos))))
+      return;
+}
 
-    if (!archiveName.empty())
-      if (archiveName.back() == '/' || archiveName.back() == '\\')
-      {
-        string fn = name;
-        if (const char * p = strrchr(fn.c_str(), '/'))
-          fn = p + 1;
-        archiveName += fn;
-      }
 
-    for (auto & ch : archiveName)
-      if (ch == '\\')
-        ch = '/';
+struct Fs8PrefetchTask
+{
+  int priority = 0;
+  uint64_t sequence = 0;
+  int64_t ticket = 0;
+  const Fs8FileSystem * owner = nullptr;
+  atomic<int> * ownerTasks = nullptr; // Fs8FileSystem::prefetchTasks, decremented last when the task is done
+  Fs8Partition * partition = nullptr;
+  shared_ptr<Fs8FileTable> table;
+  shared_ptr<Fs8ArchiveFile> file;
+  Fs8FileInfo info;
+
+  bool operator<(const Fs8PrefetchTask & other) const // max-heap: higher priority, then older first
+  {
+    return priority != other.priority ? priority < other.priority : sequence > other.sequence;
+  }
+};
 
 
-    if (ignore_list && !name.empty())
-    {
-      bool skip = false;
-      for (auto & ignore : *ignore_list)
-      {
-        if (ignore == ".")
-          if (name[0] == '.' || name.find("/.") != string::npos)
-            skip = true;
+// Background threads of prefetch(), started on the first request and shared by all file systems.
+class Fs8PrefetchPool
+{
+  mutex lock;
+  condition_variable workCondition;
+  condition_variable idleCondition;
+  vector<Fs8PrefetchTask> queue; // heap
+  unordered_map<int64_t, int> pendingByTicket; // queued and running tasks
+  unordered_map<const Fs8FileSystem *, int> runningByOwner;
+  vector<thread> workers;
+  int64_t nextTicket = 1;
+  uint64_t nextSequence = 0;
+  bool stop = false;
+
+  void finished(const Fs8PrefetchTask & task)
+  {
+    if (--pendingByTicket[task.ticket] <= 0)
+      pendingByTicket.erase(task.ticket);
+    if (--runningByOwner[task.owner] <= 0)
+      runningByOwner.erase(task.owner);
+    task.ownerTasks->fetch_sub(1);
+    idleCondition.notify_all();
+  }
 
-        string s_ignore = string("/") + ignore;
-        string ignore_s = ignore + "/";
-        string s_ignore_s = string("/") + ignore + "/";
-        if (name.find(s_ignore_s) != string::npos || name.find(ignore_s) == 0 || name == ignore)
-          skip = true;
-        size_t pos = name.rfind(s_ignore);
-        if (pos != string::npos && pos + s_ignore.length() == name.length())
-          skip = true;
+  void workerLoop()
+  {
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+      workCondition.wait(guard, [this]() { return stop || !queue.empty(); });
+      if (stop)
+        return;
 
-        if (skip)
-          break;
-      }
+      pop_heap(queue.begin(), queue.end());
+      Fs8PrefetchTask task = move(queue.back());
+      queue.pop_back();
+      runningByOwner[task.owner]++;
 
-      if (skip)
-        continue;
+      guard.unlock();
+      prefetch_entry(task.partition, task.table.get(), task.info, task.file);
+      guard.lock();
+
+      finished(task);
     }
+  }
 
-    string fullName = dir.empty() ? name : dir + "/" + name;
-    size_t fileSize = 0;
-    const char * fileData = read_whole_file(fullName.c_str(), fileSize);
-    if (!fileData)
+public:
+  ~Fs8PrefetchPool()
+  {
     {
-      Fs8FileSystem::errorLogCallback((string("Cannot read file ") + fullName).c_str());
-      fclose(outf);
-      FS_UNLINK(out_file_name_utf8.c_str());
-      return false;
+      lock_guard<mutex> guard(lock);
+      stop = true;
     }
+    workCondition.notify_all();
+    for (auto & w : workers)
+      w.join();
+  }
 
-    size_t compressBounds = ZSTD_compressBound(fileSize);
-    vector<char> compressedData(compressBounds);
-    size_t compressedSize = ZSTD_compressCCtx(zstd_compress_context.get(), &compressedData[0], compressBounds,
-      fileData, fileSize, compression_level);
+  int64_t add(vector<Fs8PrefetchTask> & tasks)
+  {
+    lock_guard<mutex> guard(lock);
+    if (workers.empty())
+      for (int i = 0; i < FS_PREFETCH_THREADS; i++)
+        workers.emplace_back([this]() { workerLoop(); });
 
-    delete[] fileData;
-    fileData = nullptr;
+    int64_t ticket = nextTicket++;
+    for (auto & task : tasks)
+    {
+      task.ticket = ticket;
+      task.sequence = nextSequence++;
+      queue.push_back(move(task));
+      push_heap(queue.begin(), queue.end());
+    }
+    if (!tasks.empty())
+      pendingByTicket[ticket] = int(tasks.size());
+    workCondition.notify_all();
+    return ticket;
+  }
 
-    Fs8FileInfo info;
-    info.compressedSize = int64_t(compressedSize);
-    info.decompressedSize = fileSize;
-    info.offsetInFile = FS_FTELL(outf);
+  bool isDone(int64_t ticket)
+  {
+    lock_guard<mutex> guard(lock);
+    return pendingByTicket.find(ticket) == pendingByTicket.end();
+  }
 
-    if (info.compressedSize > 0)
-      if (fwrite(&compressedData[0], compressedSize, 1, outf) != 1)
+  // queued tasks are dropped, the running ones are finished
+  void cancel(const Fs8FileSystem * owner, int64_t ticket, bool wait_running)
+  {
+    unique_lock<mutex> guard(lock);
+    auto last = remove_if(queue.begin(), queue.end(), [&](const Fs8PrefetchTask & task)
       {
-        Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
-        fclose(outf);
-        FS_UNLINK(out_file_name_utf8.c_str());
-        return false;
-      }
-
-    fs_file_infos[archiveName] = info;
+        if (task.owner != owner || (ticket != 0 && task.ticket != ticket))
+          return false;
+        if (--pendingByTicket[task.ticket] <= 0)
+          pendingByTicket.erase(task.ticket);
+        task.ownerTasks->fetch_sub(1);
+        return true;
+      });
+    queue.erase(last, queue.end());
+    make_heap(queue.begin(), queue.end());
+    idleCondition.notify_all();
+
+    if (wait_running)
+      idleCondition.wait(guard, [&]() { return runningByOwner.find(owner) == runningByOwner.end(); });
   }
+};
 
-  int64_t fnamesPos = FS_FTELL(outf);
+static Fs8PrefetchPool prefetch_pool;
 
-  vector<char> fnames;
-  if (!serialize_fs_file_infos(fs_file_infos, fnames) || fwrite(&fnames[0], fnames.size(), 1, outf) != 1)
+// an owner that has nothing queued or running does not lock the pool
+static void cancel_prefetch_and_wait(const Fs8FileSystem * owner, const atomic<int> & owner_tasks)
+{
+  if (owner_tasks.load() != 0)
+    prefetch_pool.cancel(owner, 0, true);
+}
+
+
+int64_t Fs8FileSystem::prefetch(const vector<string> & file_names, int priority)
+{
+  if (!partition)
+    return 0;
+
+  shared_ptr<Fs8FileTable> table;
+  shared_ptr<Fs8ArchiveFile> file;
+  partition->getState(table, file);
+
+  vector<Fs8PrefetchTask> tasks;
+  unordered_set<int64_t> offsets; // files of one solid block are loaded once
+  for (auto & name : file_names)
   {
-    Fs8FileSystem::errorLogCallback((string("Cannot write to file ") + out_file_name_utf8).c_str());
-    fclose(outf);
-    FS_UNLINK(out_file_name_utf8.c_str());
-    return false;
+    Fs8PrefetchTask task;
+    if (!table->find(name_ref(name), task.info) || task.info.decompressedSize <= 0 || !offsets.insert(task.info.offsetInFile).second)
+      continue;
+    task.priority = priority;
+    task.owner = this;
+    task.ownerTasks = &prefetchTasks;
+    task.partition = partition;
+    task.table = table;
+    task.file = file;
+    tasks.push_back(move(task));
   }
 
-  int64_t signaturesPos = FS_FTELL(outf);
-  if (signaturesPos % 8 != 0)
+  prefetchTasks.fetch_add(int(tasks.size()));
+  return prefetch_pool.add(tasks);
+}
+
+
+int64_t Fs8FileSystem::prefetchDirectory(const char * prefix, int priority)
+{
+  if (!partition || !prefix)
+    return 0;
+
+  string fprefix(prefix);
+  normalize_file_name(fprefix);
+
+  vector<string> names;
+  partition->getFileTable()->getAllFileNames(names);
+  names.erase(remove_if(names.begin(), names.end(), [&](const string & name) { return name.compare(0, fprefix.length(), fprefix) != 0; }),
+    names.end());
+  return prefetch(names, priority);
+}
+
+
+bool Fs8FileSystem::isPrefetchDone(int64_t ticket)
+{
+  return prefetch_pool.isDone(ticket);
+}
+
+
+void Fs8FileSystem::cancelPrefetch(int64_t ticket)
+{
+  prefetch_pool.cancel(this, ticket, false);
+}
+
+
+// names of all mounted archives, built at mount time and again when one of these archives gets a new file table
+struct Fs8OverlaySlot
+{
+  uint32_t tag;     // upper half of hash_file_name()
+  uint32_t archive;
+  uint32_t entry;   // entry in the file table of the archive + 1, 0 - empty slot
+};
+
+// Open addressing over the names of the archives' own tables, no name is copied.
+// Published through state_epochs like partition states, readers never lock or copy shared_ptrs.
+struct Fs8OverlayIndex
+{
+  mutable atomic<uint64_t> generation = { 0 }; // file_tables_generation the tables were last checked at
+  vector<Fs8Partition *> partitions;
+  vector<shared_ptr<Fs8FileTable>> tables; // one per partition, slots point into them
+  vector<Fs8OverlaySlot> slots;            // power of two
+  size_t count = 0;
+
+  // position of the slot with this name or of the empty slot where the probe ended
+  size_t find(const char * name, size_t length, uint64_t hash, bool name_is_normalized) const
   {
-    fwrite(&signaturesPos, 8 - signaturesPos % 8, 1, outf);
-    signaturesPos = FS_FTELL(outf);
+    uint32_t tag = uint32_t(hash >> 32);
+    size_t mask = slots.size() - 1;
+    for (size_t pos = size_t(hash) & mask;; pos = (pos + 1) & mask)
+    {
+      const Fs8OverlaySlot & slot = slots[pos];
+      if (slot.entry == 0)
+        return pos;
+      const char * entryName = nullptr;
+      size_t entryLength = 0;
+      if (slot.tag == tag && tables[slot.archive]->index.entryName(slot.entry - 1, entryName, entryLength) &&
+        entryLength == length && (name_is_normalized ? memcmp(entryName, name, length) == 0 :
+          equals_normalized(entryName, name, length)))
+        return pos;
+    }
   }
+};
 
-  FS_FSEEK(outf, 8, SEEK_SET);
-  fwrite(&fnamesPos, sizeof(fnamesPos), 1, outf);
-  fwrite(&signaturesPos, sizeof(signaturesPos), 1, outf);
-  fclose(outf);
+static const Fs8OverlayIndex * build_overlay_index(const vector<Fs8Partition *> & partitions)
+{
+  Fs8OverlayIndex * overlay = new Fs8OverlayIndex;
+  overlay->generation = file_tables_generation.load();
+  overlay->partitions = partitions;
 
-  if (!sign_file_fhash(out_file_name_utf8.c_str()))
+  size_t count = 0;
+  for (Fs8Partition * partition : partitions)
   {
-    Fs8FileSystem::errorLogCallback((string("Cannot sign file ") + out_file_name_utf8).c_str());
-    FS_UNLINK(out_file_name_utf8.c_str());
-    return false;
+    overlay->tables.push_back(partition->getFileTable());
+    count += overlay->tables.back()->index.size();
   }
+  size_t slotCount = 16;
+  while (slotCount < count * 2)
+    slotCount *= 2;
+  overlay->slots.assign(slotCount, Fs8OverlaySlot{ 0, 0, 0 });
 
-  if (write_as_hex32)
-    if (!convert_file_to_hex32(out_file_name_utf8.c_str()))
+  // the first archive that has the name keeps it
+  for (size_t a = 0; a < overlay->tables.size(); a++)
+  {
+    const Fs8Index & index = overlay->tables[a]->index;
+    for (size_t i = 0; i < index.size(); i++)
     {
-      Fs8FileSystem::errorLogCallback((string("Cannot convert file to hex32 ") + out_file_name_utf8).c_str());
-      FS_UNLINK(out_file_name_utf8.c_str());
-      return false;
+      const char * name = nullptr;
+      size_t length = 0;
+      if (!index.entryName(i, name, length))
+        continue;
+      uint64_t hash = hash_file_name(name, length);
+      Fs8OverlaySlot & slot = overlay->slots[overlay->find(name, length, hash, true)];
+      if (slot.entry == 0)
+      {
+        slot = Fs8OverlaySlot{ uint32_t(hash >> 32), uint32_t(a), uint32_t(i + 1) };
+        overlay->count++;
+      }
     }
+  }
 
-  return true;
+  return overlay;
 }
 
-
-bool Fs8FileSystem::initalizeFromFile(const char * fs8_file_name_utf8)
+// file_tables_generation changes when any partition gets a new table, only the partitions of the overlay matter
+static bool overlay_tables_changed(const Fs8OverlayIndex & overlay)
 {
-  string fullName = get_absolute_file_name(fs8_file_name_utf8);
-
-  lock_guard<recursive_mutex> lock(partitions_lock);
-  if (partition)
-    file_systems_container.unusePartition(partition);
-  partition = file_systems_container.findOrInitializePartitionFn(fullName.c_str());
-  return partition != nullptr;
+  for (size_t a = 0; a < overlay.partitions.size(); a++)
+  {
+    Fs8PinnedState state = overlay.partitions[a]->pinState();
+    if (state->fileTable != overlay.tables[a])
+      return true;
+  }
+  return false;
 }
 
-bool Fs8FileSystem::initalizeFromMemory(void * data, int64_t size)
+// 'stale' was found out of date, it is rebuilt by one thread, the others take the index it publishes
+static void rebuild_overlay_index(atomic<const Fs8OverlayIndex *> & index, mutex & rebuild_lock,
+  const Fs8OverlayIndex * stale)
 {
-  lock_guard<recursive_mutex> lock(partitions_lock);
-  if (partition)
-    file_systems_container.unusePartition(partition);
-  partition = file_systems_container.findOrInitializePartitionMem(data, size);
-  return partition != nullptr;
+  lock_guard<mutex> guard(rebuild_lock);
+  if (index.load() == stale) // not rebuilt (or unmounted) while we waited
+    state_epochs.retire(index.exchange(build_overlay_index(stale->partitions)));
 }
 
 
-void Fs8FileSystem::getAllFileNames(vector<string> & out_file_names)
+Fs8OverlayFileSystem::Fs8OverlayFileSystem()
 {
-  out_file_names.clear();
-  lock_guard<recursive_mutex> lock(partitions_lock);
-  for (auto & s : partition->fileInfos)
-    out_file_names.push_back(s.first);
 }
 
 
-bool Fs8FileSystem::fileExists(const char * file_name)
+Fs8OverlayFileSystem::~Fs8OverlayFileSystem()
 {
-  if (!partition || !file_name)
-    return false;
-  string fname(file_name);
-  normalize_file_name(fname);
-  partition->lastAccessTime = chrono::steady_clock::now();
-  lock_guard<recursive_mutex> lock(partitions_lock);
-  return partition->fileInfos.find(fname) != partition->fileInfos.end();
+  unmount();
 }
 
-int64_t Fs8FileSystem::getFileSize(const char * file_name)
-{
-  if (!partition || !file_name)
-    return false;
-  string fname(file_name);
-  normalize_file_name(fname);
-  partition->lastAccessTime = chrono::steady_clock::now();
-  lock_guard<recursive_mutex> lock(partition->decompression_lock);
-  auto it = partition->fileInfos.find(fname);
-  if (it != partition->fileInfos.end())
-    return it->second.decompressedSize;
-  else
-    return 0;
-}
 
-bool Fs8FileSystem::getFileBytes(const char * file_name, void * to_buffer, int64_t buffer_size)
+bool Fs8OverlayFileSystem::mount(const vector<string> & fs8_file_names_utf8, bool memory_mapped)
 {
-  if (to_buffer == 0)
-    return false;
+  unmount();
 
-  if (!partition)
+  vector<unique_ptr<Fs8FileSystem>> newArchives;
+  for (auto & name : fs8_file_names_utf8)
   {
-    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
-    return false;
+    newArchives.push_back(unique_ptr<Fs8FileSystem>(new Fs8FileSystem));
+    if (!newArchives.back()->initalizeFromFile(name.c_str(), memory_mapped))
+      return false;
   }
 
-  if (!file_name)
-    return false;
+  vector<Fs8Partition *> partitions;
+  for (auto & a : newArchives)
+    partitions.push_back(a->partition);
 
-  string fname(file_name);
-  normalize_file_name(fname);
-  partition->lastAccessTime = chrono::steady_clock::now();
+  archives.swap(newArchives);
+  lock_guard<mutex> guard(rebuildLock);
+  state_epochs.retire(index.exchange(build_overlay_index(partitions)));
+  return true;
+}
 
-  auto it = partition->fileInfos.find(fname);
 
-  if (it->second.decompressedSize < 0 || it->second.decompressedSize > FS_MAX_FILE_SIZE ||
-    it->second.compressedSize < 0 || it->second.compressedSize > FS_MAX_FILE_SIZE ||
-    it->second.offsetInFile < 24)
+void Fs8OverlayFileSystem::unmount()
+{
   {
-    Fs8FileSystem::errorLogCallback("Invalid file postion");
-    return false;
+    lock_guard<mutex> guard(rebuildLock);
+    state_epochs.retire(index.exchange(nullptr));
   }
+  archives.clear();
+}
 
-  if (it == partition->fileInfos.end() || it->second.decompressedSize > buffer_size)
-    return false;
 
-  Fs8FileInfo & info = it->second;
+int Fs8OverlayFileSystem::getArchiveCount()
+{
+  return int(archives.size());
+}
+
 
-  lock_guard<recursive_mutex> lock(partition->decompression_lock);
-  void * p = info.getDecompressedPtr();
-  if (p)
-  {
-    memcpy(to_buffer, p, info.decompressedSize);
-    return true;
-  }
+Fs8FileSystem * Fs8OverlayFileSystem::getArchive(int archive_index)
+{
+  return archive_index >= 0 && archive_index < int(archives.size()) ? archives[archive_index].get() : nullptr;
+}
 
-  if (info.decompressedSize == 0)
+
+void Fs8OverlayFileSystem::getAllFileNames(vector<string> & out_file_names)
+{
+  out_file_names.clear();
+  Fs8EpochGuard guard;
+  const Fs8OverlayIndex * overlay = index.load();
+  if (!overlay)
+    return;
+  out_file_names.reserve(overlay->count);
+  for (const Fs8OverlaySlot & slot : overlay->slots)
   {
-    return true;
+    const char * name = nullptr;
+    size_t length = 0;
+    if (slot.entry != 0 && overlay->tables[slot.archive]->index.entryName(slot.entry - 1, name, length))
+      out_file_names.push_back(string(name, length));
   }
+  sort(out_file_names.begin(), out_file_names.end());
+}
 
-  if (partition->isInMemory)
-  {
-    if (partition->inMemorySize > 0 && info.offsetInFile + info.compressedSize > partition->inMemorySize)
-    {
-      Fs8FileSystem::errorLogCallback("Internal error (invalid partition->inMemorySize)");
-      return false;
-    }
 
-    size_t res = ZSTD_decompressDCtx(zstd_decompress_context.get(), to_buffer, info.decompressedSize,
-      partition->inMemoryDataPtr + info.offsetInFile, info.compressedSize);
+// file found by find_overlay_file(), the index and the partition state stay alive while it exists
+struct Fs8OverlayFile
+{
+  Fs8EpochGuard guard;
+  Fs8Partition * partition = nullptr;
+  const Fs8PartitionState * state = nullptr;
+  int archive = -1;
+  Fs8FileInfo info;
+};
 
-    if (ZSTD_isError(res))
-    {
-      Fs8FileSystem::errorLogCallback((string("ZSTD decompression error1: ") + ZSTD_getErrorName(res)).c_str());
+// One lookup in the merged index, the archive state is taken from the partition the file is in.
+// An index that is out of date is rebuilt and the lookup repeated, a miss is reported only by an up to date index.
+static bool find_overlay_file(atomic<const Fs8OverlayIndex *> & index, mutex & rebuild_lock, const Fs8NameRef & name,
+  Fs8OverlayFile & out_file)
+{
+  for (;;)
+  {
+    const Fs8OverlayIndex * overlay = index.load();
+    if (!overlay)
       return false;
-    }
 
-    if (info.decompressedSize < FS_KEEP_IN_MEMORY_THRESHOLD)
+    uint64_t generation = file_tables_generation.load();
+    if (overlay->generation.load() != generation)
     {
-      char * ptr = new char[info.decompressedSize];
-      memcpy(ptr, to_buffer, info.decompressedSize);
-      info.setDecompressedPtr(ptr);
+      if (overlay_tables_changed(*overlay))
+      {
+        rebuild_overlay_index(index, rebuild_lock, overlay);
+        continue;
+      }
+      overlay->generation.store(generation); // the tables of other archives were replaced
     }
 
-    return true;
-  }
-  else
-  {
-    if (!partition->fileDescriptor)
+    // a name missing from all archives counts as one global miss
+    const Fs8OverlaySlot & slot = overlay->slots[overlay->find(name.name, name.length, name.hash, name.normalized)];
+    if (slot.entry == 0)
     {
-      Fs8FileSystem::errorLogCallback("partition->fileDescriptor is closed");
+      add_stat(nullptr, &Fs8StatCounters::lookups, 1);
+      add_stat(nullptr, &Fs8StatCounters::lookupMisses, 1);
       return false;
     }
 
-    FS_FSEEK(partition->fileDescriptor, info.offsetInFile, SEEK_SET);
-    vector<char> compressedData;
-    compressedData.resize(info.compressedSize);
-    if (fread(&compressedData[0], info.compressedSize, 1, partition->fileDescriptor) != 1)
+    Fs8Partition * partition = overlay->partitions[slot.archive];
+    partition->touch();
+    const Fs8PartitionState * state = partition->state.load();
+    if (state->fileTable != overlay->tables[slot.archive]) // replaced after the generation was checked
     {
-      Fs8FileSystem::errorLogCallback("Cannot read from file");
-      return false;
+      rebuild_overlay_index(index, rebuild_lock, overlay);
+      continue;
     }
+    add_stat(&partition->stats, &Fs8StatCounters::lookups, 1);
 
-    size_t res = ZSTD_decompressDCtx(zstd_decompress_context.get(), to_buffer, info.decompressedSize,
-      &compressedData[0], info.compressedSize);
-
-    if (ZSTD_isError(res))
+    out_file.partition = partition;
+    out_file.state = state;
+    out_file.archive = int(slot.archive);
+    if (!state->fileTable->index.entryInfo(slot.entry - 1, out_file.info))
     {
-      Fs8FileSystem::errorLogCallback((string("ZSTD decompression error2: ") + ZSTD_getErrorName(res)).c_str());
+      Fs8FileSystem::errorLogCallback("Corrupted file (unknown entry flags)");
       return false;
     }
-
-    if (info.decompressedSize < FS_KEEP_IN_MEMORY_THRESHOLD)
-    {
-      char * ptr = new char[info.decompressedSize];
-      memcpy(ptr, to_buffer, info.decompressedSize);
-      info.setDecompressedPtr(ptr);
-    }
-
     return true;
   }
 }
 
 
-bool Fs8FileSystem::getFileBytes(const char * file_name, vector<char> & out_file_bytes, bool addFinalZero)
+static bool overlay_file_bytes(atomic<const Fs8OverlayIndex *> & index, mutex & rebuild_lock, const Fs8NameRef & name,
+  vector<char> & out_file_bytes, bool addFinalZero)
 {
-  if (!partition)
-  {
-    Fs8FileSystem::errorLogCallback("Internal error (partition == null, createFs8 was not called ?)");
+  Fs8OverlayFile file;
+  if (!find_overlay_file(index, rebuild_lock, name, file))
+    return read_file_bytes_to_vector(nullptr, nullptr, false, file.info, shared_ptr<Fs8ArchiveFile>(), out_file_bytes,
+      addFinalZero);
+  return read_file_bytes_to_vector(file.partition, file.state->fileTable.get(), true, file.info, file.state->archiveFile,
+    out_file_bytes, addFinalZero);
+}
+
+
+static bool overlay_file_bytes(atomic<const Fs8OverlayIndex *> & index, mutex & rebuild_lock, const Fs8NameRef & name,
+  void * to_buffer, int64_t buffer_size)
+{
+  if (to_buffer == 0)
     return false;
-  }
 
-  if (!file_name)
+  Fs8OverlayFile file;
+  if (!find_overlay_file(index, rebuild_lock, name, file) || file.info.decompressedSize > buffer_size)
     return false;
 
-  lock_guard<recursive_mutex> lock(partition->decompression_lock);
-  int64_t fileSize = getFileSize(file_name);
+  return read_file_bytes(file.partition, file.state->fileTable.get(), file.info, file.state->archiveFile, to_buffer);
+}
 
-  if (fileSize > FS_MAX_FILE_SIZE)
-  {
-    Fs8FileSystem::errorLogCallback("File is too large");
-    return false;
-  }
 
-  if (fileSize < 0)
-  {
-    Fs8FileSystem::errorLogCallback("Invalid file size");
-    return false;
-  }
+static int64_t overlay_file_size(atomic<const Fs8OverlayIndex *> & index, mutex & rebuild_lock, const Fs8NameRef & name)
+{
+  Fs8OverlayFile file;
+  return find_overlay_file(index, rebuild_lock, name, file) ? file.info.decompressedSize : 0;
+}
 
-  if (addFinalZero)
-  {
-    out_file_bytes.resize(fileSize + 1);
-    out_file_bytes.back() = 0;
-  }
-  else
-  {
-    out_file_bytes.resize(fileSize);
-  }
-  bool res = fileSize ? getFileBytes(file_name, &out_file_bytes[0], fileSize) : true;
-  if (!res)
-    out_file_bytes.clear();
-  return res;
+
+static int overlay_file_archive(atomic<const Fs8OverlayIndex *> & index, mutex & rebuild_lock, const Fs8NameRef & name)
+{
+  Fs8OverlayFile file;
+  return find_overlay_file(index, rebuild_lock, name, file) ? file.archive : -1;
+}
+
+
+bool Fs8OverlayFileSystem::fileExists(const char * file_name)
+{
+  return getFileArchive(file_name) >= 0;
+}
+
+bool Fs8OverlayFileSystem::fileExists(std::string_view file_name)
+{
+  return getFileArchive(file_name) >= 0;
+}
+
+bool Fs8OverlayFileSystem::fileExists(const Fs8FileName & file_name)
+{
+  return getFileArchive(file_name) >= 0;
+}
+
+
+int64_t Fs8OverlayFileSystem::getFileSize(const char * file_name)
+{
+  return file_name ? getFileSize(std::string_view(file_name)) : 0;
+}
+
+int64_t Fs8OverlayFileSystem::getFileSize(std::string_view file_name)
+{
+  return overlay_file_size(index, rebuildLock, name_ref(file_name));
+}
+
+int64_t Fs8OverlayFileSystem::getFileSize(const Fs8FileName & file_name)
+{
+  return overlay_file_size(index, rebuildLock, name_ref(file_name));
+}
+
+
+int Fs8OverlayFileSystem::getFileArchive(const char * file_name)
+{
+  return file_name ? getFileArchive(std::string_view(file_name)) : -1;
+}
+
+int Fs8OverlayFileSystem::getFileArchive(std::string_view file_name)
+{
+  return overlay_file_archive(index, rebuildLock, name_ref(file_name));
+}
+
+int Fs8OverlayFileSystem::getFileArchive(const Fs8FileName & file_name)
+{
+  return overlay_file_archive(index, rebuildLock, name_ref(file_name));
+}
+
+
+bool Fs8OverlayFileSystem::getFileBytes(const char * file_name, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  return file_name ? getFileBytes(std::string_view(file_name), out_file_bytes, addFinalZero) : false;
+}
+
+bool Fs8OverlayFileSystem::getFileBytes(std::string_view file_name, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  return overlay_file_bytes(index, rebuildLock, name_ref(file_name), out_file_bytes, addFinalZero);
+}
+
+bool Fs8OverlayFileSystem::getFileBytes(const Fs8FileName & file_name, vector<char> & out_file_bytes, bool addFinalZero)
+{
+  return overlay_file_bytes(index, rebuildLock, name_ref(file_name), out_file_bytes, addFinalZero);
+}
+
+
+bool Fs8OverlayFileSystem::getFileBytes(const char * file_name, void * to_buffer, int64_t buffer_size)
+{
+  return file_name ? getFileBytes(std::string_view(file_name), to_buffer, buffer_size) : false;
+}
+
+bool Fs8OverlayFileSystem::getFileBytes(std::string_view file_name, void * to_buffer, int64_t buffer_size)
+{
+  return overlay_file_bytes(index, rebuildLock, name_ref(file_name), to_buffer, buffer_size);
 }
 
+bool Fs8OverlayFileSystem::getFileBytes(const Fs8FileName & file_name, void * to_buffer, int64_t buffer_size)
+{
+  return overlay_file_bytes(index, rebuildLock, name_ref(file_name), to_buffer, buffer_size);
+}
+
+
 Fs8FileSystem::~Fs8FileSystem()
 {
+  cancel_prefetch_and_wait(this, prefetchTasks);
   file_systems_container.unusePartition(partition);
   partition = nullptr;
 }
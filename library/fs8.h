@@ -3,11 +3,81 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <atomic>
 
 struct Fs8Partition;
+struct Fs8EntryStream;
+struct Fs8OverlayIndex;
 
 typedef void (* Fs8ErrorLogCallback)(const char *);
 
+// decompressed copies of small files, shared by all partitions, least recently used files are evicted first
+// (take the current values with getCacheSettings(), change them and pass to setCacheSettings())
+struct Fs8CacheSettings
+{
+  int64_t maxTotalBytes = 256 << 20;        // budget of all partitions together
+  int64_t maxPartitionBytes = 0;            // budget of one partition, 0 - only the total budget applies
+  int64_t keepInMemoryThreshold = 64 << 10; // files smaller than this are cached, 0 - no caching
+};
+
+// read-only bytes of a file without a copy, stay valid while the view (or any copy of it) is alive,
+// even if the file is evicted from the cache or the archive is closed
+struct Fs8FileView
+{
+  const char * bytes = nullptr;
+  int64_t size = 0;
+  std::shared_ptr<const void> holder;
+};
+
+// counters of reads since the start or the last reset, kept with relaxed atomics so they are always on
+// (per archive with Fs8FileSystem::getStats(), all archives together with getGlobalStats())
+struct Fs8Stats
+{
+  int64_t lookups = 0;            // file name lookups
+  int64_t lookupMisses = 0;       // lookups of names that are not in the archive
+  int64_t cacheHits = 0;          // reads served from the decompressed cache
+  int64_t cacheMisses = 0;        // reads of cacheable files and blocks that were not in the cache
+  int64_t bytesRead = 0;          // bytes read from archive files (memory mapped and in-memory archives are not counted)
+  int64_t bytesDecompressed = 0;  // output of zstd
+  int64_t decompressNsec = 0;     // time spent in zstd
+  int64_t cacheResidentBytes = 0; // current size of the decompressed cache, not reset
+  int64_t cacheEvictions = 0;
+  int64_t lockWaitNsec = 0;       // time spent waiting for the archive locks held by other threads
+  int64_t reopens = 0;            // archive files opened again after they were closed (unused or changed on disk)
+  int64_t reloads = 0;            // archives read again because their files changed on disk
+};
+
+// file name normalized (lower case, '/' separators) and hashed once, for names looked up many times;
+// the hash is the one stored in archives, so one Fs8FileName serves lookups in any archive
+class Fs8FileName
+{
+public:
+  Fs8FileName() = default;
+  explicit Fs8FileName(std::string_view file_name);
+  const std::string & normalized() const { return name; }
+  uint64_t hash() const { return nameHash; }
+
+private:
+  std::string name;
+  uint64_t nameHash = 0;
+};
+
+struct Fs8PackOptions
+{
+  int compressionLevel = 1;   // zstd compression level
+  int threads = 1;            // number of read/compress workers (0 - all cores), the output does not depend on it
+  double storeRatio = 0.95;   // files whose compressed/original size exceeds storeRatio are stored uncompressed (1 - only when zstd does not shrink them)
+  int64_t chunkSize = 0;      // larger files are compressed as independent chunks of this size for getFileRange(), 0 - off
+  int64_t dictionarySize = 0; // train zstd dictionaries of this size (one per file type) for small files, 0 - off
+  int64_t dictionaryFileSizeLimit = 64 << 10; // files up to this size are compressed with a dictionary
+  int64_t solidBlockSize = 0; // small files are packed together into solid blocks of this size, 0 - off
+  int64_t solidFileSizeLimit = 16 << 10; // files up to this size go to solid blocks
+  bool writeAsHex32 = false;  // write the archive as ASCII array of integers
+};
+
 struct Fs8FileSystem
 {
   static Fs8ErrorLogCallback errorLogCallback; // printf by default
@@ -15,27 +85,152 @@ struct Fs8FileSystem
   Fs8FileSystem();
   ~Fs8FileSystem();
 
-  static bool checkFs8FileSystemSignatures(const char * fs8_file_name_utf8);
+  // hashes the archive on 'threads' threads (0 - all cores), the result is remembered until the file is changed
+  static bool checkFs8FileSystemSignatures(const char * fs8_file_name_utf8, int threads = 0);
 
   static bool createFs8FromFiles(const char * dir_, const std::vector<std::string> & file_names,
     const char * out_file_name_utf8_, int compression_level = 1, bool write_as_hex32 = false,
-    std::vector<std::string> * ignore_list = nullptr);
+    std::vector<std::string> * ignore_list = nullptr, int threads = 1);
 
   // list of pairs (original file name, archive file name)
   static bool createFs8FromFiles(const char * dir_, const std::vector<std::pair<std::string, std::string>> & file_names,
     const char * out_file_name_utf8_, int compression_level = 1, bool write_as_hex32 = false,
-    std::vector<std::string> * ignore_list = nullptr);
+    std::vector<std::string> * ignore_list = nullptr, int threads = 1);
 
-  bool initalizeFromFile(const char * fs8_file_name_utf8);
+  static bool createFs8FromFiles(const char * dir_, const std::vector<std::pair<std::string, std::string>> & file_names,
+    const char * out_file_name_utf8_, const Fs8PackOptions & options, std::vector<std::string> * ignore_list = nullptr);
+
+  // Packs only new and changed files (compared with the archive by size and content hash) and appends them
+  // with a new file table, unchanged files keep their compressed bytes. Space of replaced and removed files
+  // is reclaimed by compactFs8(). Archives without content hashes (older versions) are packed from scratch.
+  static bool updateFs8FromFiles(const char * dir_, const std::vector<std::pair<std::string, std::string>> & file_names,
+    const char * fs8_file_name_utf8_, const Fs8PackOptions & options, std::vector<std::string> * ignore_list = nullptr);
+
+  // rewrites the archive without unreferenced bytes, compressed data is copied as is
+  static bool compactFs8(const char * fs8_file_name_utf8);
+
+  // memory_mapped - map the archive read-only instead of fseek + fread for every file
+  bool initalizeFromFile(const char * fs8_file_name_utf8, bool memory_mapped = false);
   bool initalizeFromMemory(void * data, int64_t size = -1);
   void getAllFileNames(std::vector<std::string> & out_file_names);
+  void getAllFileNamesInArchiveOrder(std::vector<std::string> & out_file_names); // reading in this order is sequential
+  // lookups by std::string_view or Fs8FileName do not allocate, names are normalized while they are hashed
   bool fileExists(const char * file_name);
+  bool fileExists(std::string_view file_name);
+  bool fileExists(const Fs8FileName & file_name);
   int64_t getFileSize(const char * file_name);
+  int64_t getFileSize(std::string_view file_name);
+  int64_t getFileSize(const Fs8FileName & file_name);
   bool getFileBytes(const char * file_name, std::vector<char> & out_file_bytes, bool addFinalZero = false);
+  bool getFileBytes(std::string_view file_name, std::vector<char> & out_file_bytes, bool addFinalZero = false);
+  bool getFileBytes(const Fs8FileName & file_name, std::vector<char> & out_file_bytes, bool addFinalZero = false);
   bool getFileBytes(const char * file_name, void * to_buffer, int64_t buffer_size);
+  bool getFileBytes(std::string_view file_name, void * to_buffer, int64_t buffer_size);
+  bool getFileBytes(const Fs8FileName & file_name, void * to_buffer, int64_t buffer_size);
+  bool getFileView(const char * file_name, Fs8FileView & out_view);
+  bool getFileView(std::string_view file_name, Fs8FileView & out_view);
+  bool getFileView(const Fs8FileName & file_name, Fs8FileView & out_view);
+  // bytes [offset, offset + length) of the file, only the chunks covering them are decompressed if the file
+  // was packed with Fs8PackOptions::chunkSize (otherwise the file is decompressed up to offset + length)
+  bool getFileRange(const char * file_name, int64_t offset, int64_t length, void * to_buffer);
+  bool getFileRange(std::string_view file_name, int64_t offset, int64_t length, void * to_buffer);
+  bool getFileRange(const Fs8FileName & file_name, int64_t offset, int64_t length, void * to_buffer);
+  // reads many files at once: the archive is read in offset order with adjacent files merged into large reads,
+  // 'threads' decompress them (0 - all cores). Returns false if any file is missing or cannot be read, its bytes are empty.
+  bool getFilesBytes(const std::vector<std::string> & file_names, std::vector<std::vector<char>> & out_files_bytes,
+    int threads = 1);
+
+  // warms files in background threads: small files and solid blocks are decompressed into the cache,
+  // large files are read into the OS page cache. Higher priority requests go first.
+  // Returns a ticket for isPrefetchDone() and cancelPrefetch(), pending requests are cancelled when the object is destroyed.
+  int64_t prefetch(const std::vector<std::string> & file_names, int priority = 0);
+  int64_t prefetchDirectory(const char * prefix, int priority = 0); // all files whose names start with 'prefix'
+  bool isPrefetchDone(int64_t ticket);
+  void cancelPrefetch(int64_t ticket = 0); // 0 - all requests of this object
 
   static void act();
 
+  static void setCacheSettings(const Fs8CacheSettings & settings);
+  static Fs8CacheSettings getCacheSettings();
+  static void clearCache();
+  void setCacheLimit(int64_t max_bytes); // budget of this partition, -1 - Fs8CacheSettings::maxPartitionBytes
+  // the first read of every file checks its content hash, a corrupted file fails to read (getFileRange of a part
+  // of a file is not checked). Applies to the archive, i.e. to all Fs8FileSystem objects that opened it.
+  // Archives packed before content hashes were added are not checked.
+  void setVerifyOnRead(bool verify);
+
+  // counters of the archive (shared by all Fs8FileSystem objects that opened it) and of all archives together
+  Fs8Stats getStats();
+  void resetStats();
+  static Fs8Stats getGlobalStats();
+  static void resetGlobalStats();
+
 private:
+  friend class Fs8FileReader;
+  friend struct Fs8OverlayFileSystem;
   Fs8Partition * partition = nullptr;
+  std::atomic<int> prefetchTasks = { 0 }; // queued and running, 0 - open and close do not touch the prefetch pool
+};
+
+// several archives searched as one (base archive, patches, DLC): a file is taken from the first archive
+// in the search path that has it. Names of all archives are merged into one index when they are mounted,
+// so a lookup costs the same for any number of archives.
+struct Fs8OverlayFileSystem
+{
+  Fs8OverlayFileSystem();
+  ~Fs8OverlayFileSystem();
+
+  // replaces the mounted archives, the first archive has the highest priority
+  bool mount(const std::vector<std::string> & fs8_file_names_utf8, bool memory_mapped = false);
+  void unmount();
+  int getArchiveCount();
+  Fs8FileSystem * getArchive(int index); // for the features of a single archive (views, ranges, prefetch)
+
+  void getAllFileNames(std::vector<std::string> & out_file_names);
+  // lookups by std::string_view or Fs8FileName do not allocate, as in Fs8FileSystem
+  bool fileExists(const char * file_name);
+  bool fileExists(std::string_view file_name);
+  bool fileExists(const Fs8FileName & file_name);
+  int64_t getFileSize(const char * file_name);
+  int64_t getFileSize(std::string_view file_name);
+  int64_t getFileSize(const Fs8FileName & file_name);
+  int getFileArchive(const char * file_name); // index of the archive the file is taken from, -1 - not found
+  int getFileArchive(std::string_view file_name);
+  int getFileArchive(const Fs8FileName & file_name);
+  bool getFileBytes(const char * file_name, std::vector<char> & out_file_bytes, bool addFinalZero = false);
+  bool getFileBytes(std::string_view file_name, std::vector<char> & out_file_bytes, bool addFinalZero = false);
+  bool getFileBytes(const Fs8FileName & file_name, std::vector<char> & out_file_bytes, bool addFinalZero = false);
+  bool getFileBytes(const char * file_name, void * to_buffer, int64_t buffer_size);
+  bool getFileBytes(std::string_view file_name, void * to_buffer, int64_t buffer_size);
+  bool getFileBytes(const Fs8FileName & file_name, void * to_buffer, int64_t buffer_size);
+
+private:
+  Fs8OverlayFileSystem(const Fs8OverlayFileSystem &) = delete;
+  Fs8OverlayFileSystem & operator=(const Fs8OverlayFileSystem &) = delete;
+
+  std::vector<std::unique_ptr<Fs8FileSystem>> archives;
+  std::atomic<const Fs8OverlayIndex *> index = { nullptr }; // retired through the epochs of partition states
+  std::mutex rebuildLock; // one thread rebuilds a stale index, the others wait for it
+};
+
+// sequential reader for files of any size, decompresses through a small working buffer
+// (the whole file is never in memory), keeps the archive open until close()
+class Fs8FileReader
+{
+public:
+  Fs8FileReader();
+  ~Fs8FileReader();
+
+  bool open(Fs8FileSystem & fs, const char * file_name);
+  void close();
+  int64_t read(void * buffer, int64_t size); // number of bytes read, 0 - end of file, -1 - error
+  int64_t size() const;
+  int64_t position() const;
+  bool isOpen() const { return stream != nullptr; }
+
+private:
+  Fs8FileReader(const Fs8FileReader &) = delete;
+  Fs8FileReader & operator=(const Fs8FileReader &) = delete;
+
+  Fs8EntryStream * stream = nullptr;
 };
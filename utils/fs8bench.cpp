@@ -0,0 +1,460 @@
+#include "../library/fs8.h"
+#include "../library/fs8.cpp"
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+
+// Benchmark of packing and reading, results are printed as JSON (progress goes to stderr).
+// The corpus is generated from a fixed seed, so runs of different versions compare the same data.
+
+static string work_dir = "fs8bench.tmp";
+static vector<int> levels;
+static double scale = 1.0;
+static int threads = 0;
+static int iterations = 5;
+static bool memory_mapped = false;
+static bool keep = false;
+static const char * out_file_name = nullptr;
+
+
+void usage()
+{
+  printf("Usage: fs8bench [--dir:work-dir] [--levels:1,3,9] [--scale:S] [--threads:N] [--iterations:N] [--mmap] [--keep] [--out:result.json]\n"
+    "\n"
+    "--dir:work-dir - directory for the generated corpus and archives (fs8bench.tmp by default), must not exist or be empty,\n"
+    "  the corpus and the archives are removed at the end (and the directory, if it was created).\n"
+    "--levels:L1,L2,... - zstd levels to measure pack throughput with (1,3,9 by default), reads use the first level.\n"
+    "--scale:S - multiplies the number of files in the corpus (1 by default).\n"
+    "--threads:N - packer threads (0 - all cores, default).\n"
+    "--iterations:N - passes over all names when measuring lookups (5 by default).\n"
+    "--mmap - read the archive memory mapped.\n"
+    "--keep - do not remove the corpus and the archives.\n"
+    "--out:file - write the JSON to the file instead of stdout.\n"
+    "\n"
+  );
+}
+
+
+// splitmix64, the same sequence on every platform
+struct BenchRandom
+{
+  uint64_t state;
+
+  explicit BenchRandom(uint64_t seed) : state(seed) {}
+
+  uint64_t next()
+  {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+
+  // sizes spread evenly over orders of magnitude
+  int64_t logRange(int64_t from, int64_t to)
+  {
+    double x = double(next() >> 11) / double(1ull << 53);
+    return int64_t(double(from) * pow(double(to) / double(from), x));
+  }
+};
+
+
+struct BenchSet
+{
+  const char * name;
+  bool text;          // compressible text, otherwise random bytes
+  int64_t count;
+  int64_t minSize;
+  int64_t maxSize;
+  vector<string> fileNames;
+  int64_t totalBytes = 0;
+
+  BenchSet(const char * name_, bool text_, int64_t count_, int64_t min_size, int64_t max_size) :
+    name(name_), text(text_), count(count_), minSize(min_size), maxSize(max_size)
+  {
+  }
+};
+
+
+static void append_text(BenchRandom & rnd, vector<char> & out, int64_t size)
+{
+  static const char * words[] = { "texture", "mesh", "shader", "level", "sound", "actor", "vertex", "index",
+    "material", "light", "camera", "script", "value", "=", "{", "}", "0", "1", "0.5", "true", "false", "\n" };
+  const int wordCount = int(sizeof(words) / sizeof(words[0]));
+
+  size_t end = out.size() + size_t(size);
+  while (out.size() < end)
+  {
+    const char * w = words[rnd.next() % wordCount];
+    out.insert(out.end(), w, w + strlen(w));
+    out.push_back(' ');
+  }
+  out.resize(end);
+}
+
+static void append_random(BenchRandom & rnd, vector<char> & out, int64_t size)
+{
+  size_t pos = out.size();
+  out.resize(pos + size_t(size));
+  for (int64_t i = 0; i < size; i += 8)
+  {
+    uint64_t v = rnd.next();
+    memcpy(&out[pos + size_t(i)], &v, size_t(min(int64_t(8), size - i)));
+  }
+}
+
+static bool write_bench_file(const string & file_name, const vector<char> & data, const char * mode = "wb")
+{
+  FILE * f = FS_FOPEN(file_name.c_str(), mode);
+  if (!f)
+    return false;
+  bool ok = data.empty() || fwrite(&data[0], data.size(), 1, f) == 1;
+  return fclose(f) == 0 && ok;
+}
+
+static bool generate_corpus(const string & corpus_dir, vector<BenchSet> & sets, string & huge_name, int64_t & huge_size)
+{
+  BenchRandom rnd(8);
+  vector<char> data;
+  error_code errCode;
+
+  for (auto & set : sets)
+  {
+    filesystem::create_directories(filesystem::path(string_to_wstring(corpus_dir + "/" + set.name)), errCode);
+    int64_t count = max(int64_t(1), int64_t(double(set.count) * scale));
+    for (int64_t i = 0; i < count; i++)
+    {
+      char name[64] = { 0 };
+      snprintf(name, sizeof(name), "%s/%06d.%s", set.name, int(i), set.text ? "txt" : "bin");
+      int64_t size = set.minSize == set.maxSize ? set.minSize : rnd.logRange(set.minSize, set.maxSize);
+      data.clear();
+      if (set.text)
+        append_text(rnd, data, size);
+      else
+        append_random(rnd, data, size);
+      if (!write_bench_file(corpus_dir + "/" + name, data))
+        return false;
+      set.fileNames.push_back(name);
+      set.totalBytes += size;
+    }
+  }
+
+  // one file above FS_STREAM_THRESHOLD, written in pieces
+  huge_name = "huge/000000.txt";
+  huge_size = FS_STREAM_THRESHOLD + (16 << 20);
+  filesystem::create_directories(filesystem::path(string_to_wstring(corpus_dir + "/huge")), errCode);
+  for (int64_t pos = 0; pos < huge_size; pos += (1 << 20))
+  {
+    data.clear();
+    append_text(rnd, data, min(int64_t(1 << 20), huge_size - pos));
+    if (!write_bench_file(corpus_dir + "/" + huge_name, data, pos == 0 ? "wb" : "ab"))
+      return false;
+  }
+
+  return true;
+}
+
+
+static double now_sec()
+{
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static string format(const char * fmt, ...)
+{
+  char buf[512] = { 0 };
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  return string(buf);
+}
+
+// {"count", "mean", "p50", "p90", "p99", "max"} of the samples in microseconds
+static string percentiles_json(vector<double> & usec)
+{
+  if (usec.empty())
+    return "{ \"count\": 0 }";
+  sort(usec.begin(), usec.end());
+  double sum = 0;
+  for (double v : usec)
+    sum += v;
+  auto at = [&](double q) { return usec[min(usec.size() - 1, size_t(q * double(usec.size())))]; };
+  return format("{ \"count\": %d, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f }",
+    int(usec.size()), sum / double(usec.size()), at(0.5), at(0.9), at(0.99), usec.back());
+}
+
+// reads every file once, returns false if any read fails
+static bool read_files(Fs8FileSystem & fs, const vector<string> & names, vector<double> & usec)
+{
+  vector<char> bytes;
+  usec.clear();
+  usec.reserve(names.size());
+  for (auto & name : names)
+  {
+    double t = now_sec();
+    if (!fs.getFileBytes(name.c_str(), bytes))
+    {
+      fprintf(stderr, "ERROR: cannot read %s\n", name.c_str());
+      return false;
+    }
+    usec.push_back((now_sec() - t) * 1e6);
+  }
+  return true;
+}
+
+
+int main(int argc, char ** argv)
+{
+  for (int i = 1; i < argc; i++)
+    if (!strncmp(argv[i], "--dir:", 6))
+      work_dir = argv[i] + 6;
+    else if (!strncmp(argv[i], "--levels:", 9))
+    {
+      for (const char * p = argv[i] + 9; *p; p++)
+        if (p == argv[i] + 9 || p[-1] == ',')
+          levels.push_back(atoi(p));
+    }
+    else if (!strncmp(argv[i], "--scale:", 8))
+      scale = atof(argv[i] + 8);
+    else if (!strncmp(argv[i], "--threads:", 10))
+      threads = atoi(argv[i] + 10);
+    else if (!strncmp(argv[i], "--iterations:", 13))
+      iterations = max(atoi(argv[i] + 13), 1);
+    else if (!strcmp(argv[i], "--mmap"))
+      memory_mapped = true;
+    else if (!strcmp(argv[i], "--keep"))
+      keep = true;
+    else if (!strncmp(argv[i], "--out:", 6))
+      out_file_name = argv[i] + 6;
+    else
+    {
+      printf("ERROR: Unknown argument %s\n", argv[i]);
+      usage();
+      return 1;
+    }
+
+  if (levels.empty())
+    levels = { 1, 3, 9 };
+
+  vector<BenchSet> sets = {
+    { "tiny", true, 20000, 16, 1024 },
+    { "mixed", true, 2000, 1 << 10, 1 << 20 },
+    { "random", false, 200, 4 << 10, 256 << 10 },
+  };
+
+  // only what the benchmark creates is removed, so a directory with anything in it is not used
+  error_code errCode;
+  filesystem::path workPath(string_to_wstring(work_dir));
+  bool workDirCreated = !filesystem::exists(workPath, errCode);
+  if (!workDirCreated && !filesystem::is_empty(workPath, errCode))
+  {
+    fprintf(stderr, "ERROR: work directory %s is not empty\n", work_dir.c_str());
+    return 1;
+  }
+
+  string corpusDir = work_dir + "/corpus";
+  string hugeName;
+  int64_t hugeSize = 0;
+  fprintf(stderr, "generating corpus in %s\n", corpusDir.c_str());
+  if (!generate_corpus(corpusDir, sets, hugeName, hugeSize))
+  {
+    fprintf(stderr, "ERROR: cannot write corpus to %s\n", corpusDir.c_str());
+    return 1;
+  }
+
+  int64_t corpusFiles = 1;
+  int64_t corpusBytes = hugeSize;
+  for (auto & set : sets)
+  {
+    corpusFiles += int64_t(set.fileNames.size());
+    corpusBytes += set.totalBytes;
+  }
+
+  string json = "{\n";
+  json += format("  \"format_version\": %d,\n  \"scale\": %g,\n  \"threads\": %d,\n  \"memory_mapped\": %s,\n",
+    FS_FORMAT_VERSION, scale, threads, memory_mapped ? "true" : "false");
+
+  json += format("  \"corpus\": { \"files\": %lld, \"bytes\": %lld, \"sets\": {", (long long)corpusFiles, (long long)corpusBytes);
+  for (auto & set : sets)
+    json += format(" \"%s\": { \"files\": %d, \"bytes\": %lld },", set.name, int(set.fileNames.size()), (long long)set.totalBytes);
+  json += format(" \"huge\": { \"files\": 1, \"bytes\": %lld } } },\n", (long long)hugeSize);
+
+  // pack throughput per level, every level is packed to its own archive
+  vector<string> archives;
+  json += "  \"pack\": [\n";
+  for (size_t i = 0; i < levels.size(); i++)
+  {
+    Fs8PackOptions options;
+    options.compressionLevel = levels[i];
+    options.threads = threads;
+    string archive = work_dir + format("/level%d.fs8", levels[i]);
+    fprintf(stderr, "packing level %d\n", levels[i]);
+
+    // the mask carries the directory, archive names are relative to it
+    vector<pair<string, string>> fileNames = { make_pair(corpusDir + "/*", string("/*")) };
+    double t = now_sec();
+    if (!Fs8FileSystem::createFs8FromFiles("", fileNames, archive.c_str(), options))
+    {
+      fprintf(stderr, "ERROR: cannot pack %s\n", archive.c_str());
+      return 1;
+    }
+    double sec = now_sec() - t;
+    int64_t archiveBytes = get_file_size(archive);
+    archives.push_back(archive);
+
+    json += format("    { \"level\": %d, \"seconds\": %.3f, \"mb_per_sec\": %.2f, \"archive_bytes\": %lld, \"ratio\": %.4f }%s\n",
+      levels[i], sec, double(corpusBytes) / 1048576.0 / sec, (long long)archiveBytes,
+      double(archiveBytes) / double(corpusBytes), i + 1 < levels.size() ? "," : "");
+  }
+  json += "  ],\n";
+
+  // open: the first open reads the file table, later opens find the archive already known
+  fprintf(stderr, "reading %s\n", archives[0].c_str());
+  unique_ptr<Fs8FileSystem> fsHolder(new Fs8FileSystem);
+  Fs8FileSystem & fs = *fsHolder;
+  double t = now_sec();
+  if (!fs.initalizeFromFile(archives[0].c_str(), memory_mapped))
+  {
+    fprintf(stderr, "ERROR: cannot open %s\n", archives[0].c_str());
+    return 1;
+  }
+  double firstOpenUsec = (now_sec() - t) * 1e6;
+
+  vector<double> usec;
+  for (int i = 0; i < 100; i++)
+  {
+    Fs8FileSystem reopened;
+    t = now_sec();
+    reopened.initalizeFromFile(archives[0].c_str(), memory_mapped);
+    usec.push_back((now_sec() - t) * 1e6);
+  }
+  json += format("  \"open\": { \"first_usec\": %.3f, \"reopen_usec\": %s },\n", firstOpenUsec, percentiles_json(usec).c_str());
+
+  // lookups: names in archive order, misses differ from existing names only at the end
+  vector<string> names;
+  fs.getAllFileNames(names);
+  vector<string> missing;
+  for (auto & name : names)
+    missing.push_back(name + ".missing");
+
+  auto lookupNsec = [&](const vector<string> & list, bool size_query)
+  {
+    double start = now_sec();
+    for (int it = 0; it < iterations; it++)
+      for (auto & name : list)
+        if (size_query)
+          fs.getFileSize(name.c_str());
+        else
+          fs.fileExists(name.c_str());
+    return (now_sec() - start) * 1e9 / double(max(size_t(1), list.size() * size_t(iterations)));
+  };
+  double existsHit = lookupNsec(names, false);
+  double existsMiss = lookupNsec(missing, false);
+  double sizeHit = lookupNsec(names, true);
+  json += format("  \"lookup_nsec\": { \"names\": %d, \"file_exists_hit\": %.1f, \"file_exists_miss\": %.1f, \"get_file_size\": %.1f },\n",
+    int(names.size()), existsHit, existsMiss, sizeHit);
+
+  // getFileBytes: cold - the first read after clearCache(), warm - the second read, files in random order
+  BenchRandom rnd(64);
+  json += "  \"read_usec\": {\n";
+  for (auto & set : sets)
+  {
+    vector<string> order = set.fileNames;
+    for (size_t i = order.size(); i > 1; i--)
+      swap(order[i - 1], order[size_t(rnd.next() % i)]);
+
+    Fs8FileSystem::clearCache();
+    vector<double> cold, warm;
+    if (!read_files(fs, order, cold) || !read_files(fs, order, warm))
+      return 1;
+    json += format("    \"%s\": {\n      \"cold\": %s,\n", set.name, percentiles_json(cold).c_str());
+    json += format("      \"warm\": %s\n    },\n", percentiles_json(warm).c_str());
+  }
+
+  vector<char> hugeBytes;
+  t = now_sec();
+  bool hugeOk = fs.getFileBytes(hugeName.c_str(), hugeBytes);
+  double hugeSec = now_sec() - t;
+  hugeBytes = vector<char>();
+
+  Fs8FileReader reader;
+  vector<char> buffer(1 << 20);
+  t = now_sec();
+  hugeOk = hugeOk && reader.open(fs, hugeName.c_str());
+  int64_t streamed = 0;
+  for (int64_t n = 0; hugeOk && (n = reader.read(&buffer[0], int64_t(buffer.size()))) > 0;)
+    streamed += n;
+  reader.close();
+  double streamSec = now_sec() - t;
+  if (!hugeOk || streamed != hugeSize)
+  {
+    fprintf(stderr, "ERROR: cannot read %s\n", hugeName.c_str());
+    return 1;
+  }
+  json += format("    \"huge\": { \"bytes\": %lld, \"get_file_bytes_mb_per_sec\": %.2f, \"reader_mb_per_sec\": %.2f }\n  },\n",
+    (long long)hugeSize, double(hugeSize) / 1048576.0 / hugeSec, double(hugeSize) / 1048576.0 / streamSec);
+
+  // cache: warm reads of the tiny files with the default cache, without cache and with a budget smaller than the set,
+  // the counters are taken over the second pass
+  Fs8Stats totalStats = fs.getStats();
+  Fs8CacheSettings defaultSettings = Fs8FileSystem::getCacheSettings();
+  const char * cacheModes[] = { "cached", "uncached", "quarter_budget" };
+  json += "  \"cache\": {\n";
+  for (int mode = 0; mode < 3; mode++)
+  {
+    Fs8CacheSettings settings = defaultSettings;
+    if (mode == 1)
+      settings.keepInMemoryThreshold = 0;
+    if (mode == 2)
+      settings.maxTotalBytes = max(int64_t(1), sets[0].totalBytes / 4);
+    Fs8FileSystem::setCacheSettings(settings);
+    Fs8FileSystem::clearCache();
+
+    vector<double> reads;
+    bool ok = read_files(fs, sets[0].fileNames, reads);
+    fs.resetStats();
+    ok = ok && read_files(fs, sets[0].fileNames, reads);
+    Fs8Stats stats = fs.getStats();
+    Fs8FileSystem::setCacheSettings(defaultSettings);
+    if (!ok)
+      return 1;
+
+    json += format("    \"%s\": { \"max_total_bytes\": %lld, \"hits\": %lld, \"misses\": %lld, \"evictions\": %lld, "
+      "\"resident_bytes\": %lld,\n      \"read_usec\": %s }%s\n", cacheModes[mode], (long long)settings.maxTotalBytes,
+      (long long)stats.cacheHits, (long long)stats.cacheMisses, (long long)stats.cacheEvictions,
+      (long long)stats.cacheResidentBytes, percentiles_json(reads).c_str(), mode < 2 ? "," : "");
+  }
+  json += "  },\n";
+
+  // counters of everything above except the cache runs
+  json += format("  \"stats\": { \"lookups\": %lld, \"lookup_misses\": %lld, \"cache_hits\": %lld, \"cache_misses\": %lld, "
+    "\"bytes_read\": %lld, \"bytes_decompressed\": %lld, \"decompress_msec\": %.3f, \"lock_wait_msec\": %.3f }\n",
+    (long long)totalStats.lookups, (long long)totalStats.lookupMisses, (long long)totalStats.cacheHits,
+    (long long)totalStats.cacheMisses, (long long)totalStats.bytesRead, (long long)totalStats.bytesDecompressed,
+    double(totalStats.decompressNsec) / 1e6, double(totalStats.lockWaitNsec) / 1e6);
+  json += "}\n";
+
+  fsHolder.reset(); // closes the archive before it is removed
+  if (!keep)
+  {
+    filesystem::remove_all(filesystem::path(string_to_wstring(corpusDir)), errCode);
+    for (auto & archive : archives)
+      filesystem::remove(filesystem::path(string_to_wstring(archive)), errCode);
+    if (workDirCreated)
+      filesystem::remove(workPath, errCode); // not recursive, only if nothing else was put there
+  }
+
+  if (out_file_name)
+  {
+    if (!write_bench_file(out_file_name, vector<char>(json.begin(), json.end()), "wt"))
+    {
+      fprintf(stderr, "ERROR: cannot write %s\n", out_file_name);
+      return 1;
+    }
+  }
+  else
+    printf("%s", json.c_str());
+
+  return 0;
+}
@@ -83,9 +83,12 @@ static bool make_path(string path)
 
 void usage()
 {
-  printf("Usage: fs8extract <archive.fs8> [--list:list-of-files.txt] [--dir:extract-to-dir] [--all] [--size-limit:limit] [--just-show-files] [file-name1] [file-name2]\n"
+  printf("Usage: fs8extract <archive.fs8> [--list:list-of-files.txt] [--dir:extract-to-dir] [--all] [--size-limit:limit] [--mmap] [--threads:N] [--verify] [--just-show-files] [file-name1] [file-name2]\n"
     "\n"
     "List of files - just list of file names in archive, each file on the new line.\n"
+    "--mmap - map the archive into memory instead of reading it with fread.\n"
+    "--threads:N - number of threads decompressing and writing files (1 by default, 0 - all cores).\n"
+    "--verify - check the content hash of every extracted file.\n"
     "\n"
   );
 }
@@ -97,6 +100,9 @@ int main(int argc, char ** argv)
   string extractToDir = ".";
   bool extractAll = false;
   bool justShowFiles = false;
+  bool memoryMapped = false;
+  bool verify = false;
+  int threads = 1;
   int64_t sizeLimit = -1;
 
   vector<const char *> arg;
@@ -109,6 +115,12 @@ int main(int argc, char ** argv)
       extractAll = true;
     else if (!strcmp(argv[i], "--just-show-files"))
       justShowFiles = true;
+    else if (!strcmp(argv[i], "--mmap"))
+      memoryMapped = true;
+    else if (!strcmp(argv[i], "--verify"))
+      verify = true;
+    else if (!strncmp(argv[i], "--threads:", 10))
+      threads = atoi(argv[i] + 10);
     else if (!strncmp(argv[i], "--list:", 7))
       filesListFn = argv[i] + 7;
     else if (!strncmp(argv[i], "--dir:", 6))
@@ -129,8 +141,9 @@ int main(int argc, char ** argv)
 
   const char * archiveFileName = arg[0];
   Fs8FileSystem fs;
-  if (!fs.initalizeFromFile(archiveFileName))
+  if (!fs.initalizeFromFile(archiveFileName, memoryMapped))
     return 1;
+  fs.setVerifyOnRead(verify);
 
   if (!make_path(extractToDir))
   {
@@ -188,57 +201,149 @@ int main(int argc, char ** argv)
     return 1;
   }
 
-  sort(fileNames.begin(), fileNames.end());
-  string prevDirectory;
-  int64_t sizeSum = 0;
-  for (auto & n : fileNames)
+  // archive order keeps the reads sequential, every name is looked up here once and its size kept for the workers
+  vector<int64_t> fileSizes;
   {
-    size_t pos = n.find_last_of('/');
-    string directory = (pos == std::string::npos) ? string() : n.substr(0, pos);
-    if (directory != prevDirectory)
+    vector<string> archiveOrder;
+    fs.getAllFileNamesInArchiveOrder(archiveOrder);
+    unordered_map<string, size_t> rank;
+    for (size_t i = 0; i < archiveOrder.size(); i++)
+      rank[archiveOrder[i]] = i;
+
+    struct OrderedFile
     {
-      prevDirectory = directory;
-      if (!directory.empty())
-        if (!make_path(extractToDir + "/" + directory))
-        {
-          printf("ERROR: Cannot create directory %s\n", extractToDir.c_str());
-          return 1;
-        }
+      size_t rank;
+      string name;
+      int64_t size;
+    };
+
+    vector<OrderedFile> ordered;
+    for (auto & n : fileNames)
+    {
+      string normalized = n;
+      normalize_file_name(normalized);
+      auto it = rank.find(normalized);
+      if (it == rank.end())
+      {
+        printf("ERROR: File %s is not in the archive\n", n.c_str());
+        return 1;
+      }
+      ordered.push_back(OrderedFile{ it->second, n, fs.getFileSize(n.c_str()) });
     }
+    stable_sort(ordered.begin(), ordered.end(),
+      [](const OrderedFile & a, const OrderedFile & b) { return a.rank < b.rank; });
+    fileSizes.resize(ordered.size());
+    for (size_t i = 0; i < ordered.size(); i++)
+    {
+      fileNames[i] = ordered[i].name;
+      fileSizes[i] = ordered[i].size;
+    }
+  }
+
+  vector<string> directories;
+  int64_t sizeSum = 0;
+  for (size_t i = 0; i < fileNames.size(); i++)
+  {
+    const string & n = fileNames[i];
+    size_t pos = n.find_last_of('/');
+    if (pos != std::string::npos)
+      directories.push_back(n.substr(0, pos));
 
-    int64_t size = fs.getFileSize(n.c_str());
-    sizeSum += size;
+    sizeSum += fileSizes[i];
     if (sizeLimit > 0 && sizeSum > sizeLimit)
     {
       printf("ERROR: Total size of extracted files is out of limit\n");
       return 1;
     }
+  }
 
-    std::vector<char> bytes;
-    if (!fs.getFileBytes(n.c_str(), bytes, false))
-    {
-      printf("ERROR: Cannot extract file %s\n", n.c_str());
-      return 1;
-    }
-    
-    string fullName = string(extractToDir) + "/" + n;
-    FILE * savef = FS_FOPEN(fullName.c_str(), "wb");
-    if (!savef)
+  sort(directories.begin(), directories.end());
+  directories.erase(unique(directories.begin(), directories.end()), directories.end());
+  for (auto & directory : directories)
+    if (!make_path(extractToDir + "/" + directory))
     {
-      printf("ERROR: Cannot create file %s\n", fullName.c_str());
+      printf("ERROR: Cannot create directory %s\n", extractToDir.c_str());
       return 1;
     }
 
-    if (bytes.size() > 0 && fwrite(&bytes[0], bytes.size(), 1, savef) != 1)
+  if (threads <= 0)
+    threads = int(thread::hardware_concurrency());
+  threads = max(1, min(threads, int(fileNames.size())));
+
+  atomic<size_t> nextFile(0);
+  atomic<bool> failed(false);
+  mutex errorLock;
+  string error;
+
+  // every thread reuses its buffers, large files go through a fixed size buffer
+  auto extract = [&]()
+  {
+    const int64_t streamThreshold = 16 << 20;
+    vector<char> bytes;
+    vector<char> streamBuffer(1 << 20);
+
+    for (size_t i = nextFile++; i < fileNames.size() && !failed; i = nextFile++)
     {
-      printf("ERROR: Cannot write to file %s\n", fullName.c_str());
-      fclose(savef);
-      return 1;
+      const string & n = fileNames[i];
+      string fullName = string(extractToDir) + "/" + n;
+      string fileError;
+
+      int64_t size = fileSizes[i];
+      FILE * savef = FS_FOPEN(fullName.c_str(), "wb");
+      if (!savef)
+        fileError = "Cannot create file " + fullName;
+      else if (size > streamThreshold)
+      {
+        Fs8FileReader reader;
+        bool writeOk = true;
+        int64_t readBytes = 0;
+        if (reader.open(fs, n.c_str()))
+          while (writeOk && (readBytes = reader.read(&streamBuffer[0], int64_t(streamBuffer.size()))) > 0)
+            writeOk = fwrite(&streamBuffer[0], size_t(readBytes), 1, savef) == 1;
+        else
+          readBytes = -1;
+
+        if (readBytes < 0)
+          fileError = "Cannot extract file " + n;
+        else if (!writeOk)
+          fileError = "Cannot write to file " + fullName;
+      }
+      else
+      {
+        if (bytes.size() < size_t(size + 1))
+          bytes.resize(size_t(size + 1));
+        if (!fs.getFileBytes(n.c_str(), &bytes[0], size))
+          fileError = "Cannot extract file " + n;
+        else if (size > 0 && fwrite(&bytes[0], size_t(size), 1, savef) != 1)
+          fileError = "Cannot write to file " + fullName;
+      }
+
+      if (savef)
+        fclose(savef);
+
+      if (!fileError.empty())
+      {
+        lock_guard<mutex> guard(errorLock);
+        if (!failed)
+          error = fileError;
+        failed = true;
+      }
     }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < threads; i++)
+    workers.emplace_back(extract);
+  extract();
+  for (auto & w : workers)
+    w.join();
 
-    fclose(savef);
+  if (failed)
+  {
+    printf("ERROR: %s\n", error.c_str());
+    return 1;
   }
-  
+
   printf("Extracted %d file(s)\n", int(fileNames.size()));
 
   return 0;
@@ -1,8 +1,9 @@
 #include "../library/fs8.h"
 #include "../library/fs8.cpp"
 
-static bool hex_output = false;
-static int compression_level = 1;
+static Fs8PackOptions options;
+static bool update = false;
+static bool compact = false;
 
 static char * skip_utf8_bom(char * ptr)
 {
@@ -14,12 +15,20 @@ static char * skip_utf8_bom(char * ptr)
 
 void usage()
 {
-  printf("Usage: fs8pack [--hex] [--level:N] [--list:list-of-files.txt] [--ignore:ignore-name] [--ignore-dot-name] <initial-directory> <out-file-name.fs8>\n"
+  printf("Usage: fs8pack [--hex] [--level:N] [--threads:N] [--store-ratio:R] [--chunk-size:N] [--dictionary:N] [--solid:N] [--update] [--compact] [--list:list-of-files.txt] [--ignore:ignore-name] [--ignore-dot-name] <initial-directory> <out-file-name.fs8>\n"
+    "       fs8pack --compact <file-name.fs8>\n"
     "\n"
     "List of files - just list of <file-name> or <file-name> <file-name-in-archive>, each file on the new line.\n"
     "Allowed wildcards (*) instead of the last file name (dir1/dir2/*) this means recursive search\n"
     "--hex - output as ASCII array of integers.\n"
     "--level:N - zstd compression level (1 by default).\n"
+    "--threads:N - number of threads reading and compressing files (1 by default, 0 - all cores).\n"
+    "--store-ratio:R - store files uncompressed if compressed/original size > R (0.95 by default, 1 - only if zstd does not help).\n"
+    "--chunk-size:N - compress files larger than N KB as independent N KB chunks, for fast reads of a part of a file (off by default).\n"
+    "--solid:N - pack files up to 16 KB together into N KB blocks, one decompression serves the whole block (off by default).\n"
+    "--update - pack only new and changed files and append them to the existing archive, unchanged files are kept as is.\n"
+    "--compact - rewrite the archive without the space left by replaced and removed files, alone or after --update (not with --hex).\n"
+    "--dictionary:N - train N KB zstd dictionaries (one per file extension) and compress files up to 64 KB with them (off by default, 112 is a good start).\n"
     "\n"
   );
 }
@@ -34,9 +43,23 @@ int main(int argc, char ** argv)
     if (argv[i][0] != '-')
       arg.push_back(argv[i]);
     else if (!strcmp(argv[i], "--hex"))
-      hex_output = true;
+      options.writeAsHex32 = true;
     else if (!strncmp(argv[i], "--level:", 8))
-      compression_level = atoi(argv[i] + 8);
+      options.compressionLevel = atoi(argv[i] + 8);
+    else if (!strncmp(argv[i], "--threads:", 10))
+      options.threads = atoi(argv[i] + 10);
+    else if (!strncmp(argv[i], "--store-ratio:", 14))
+      options.storeRatio = atof(argv[i] + 14);
+    else if (!strncmp(argv[i], "--chunk-size:", 13))
+      options.chunkSize = int64_t(atoi(argv[i] + 13)) << 10;
+    else if (!strncmp(argv[i], "--dictionary:", 13))
+      options.dictionarySize = int64_t(atoi(argv[i] + 13)) << 10;
+    else if (!strncmp(argv[i], "--solid:", 8))
+      options.solidBlockSize = int64_t(atoi(argv[i] + 8)) << 10;
+    else if (!strcmp(argv[i], "--update"))
+      update = true;
+    else if (!strcmp(argv[i], "--compact"))
+      compact = true;
     else if (!strncmp(argv[i], "--list:", 7))
       listOfFilesFn = argv[i] + 7;
     else if (!strncmp(argv[i], "--ignore:", 9))
@@ -49,12 +72,33 @@ int main(int argc, char ** argv)
       return 1;
     }
 
+  if (compact && options.writeAsHex32)
+  {
+    printf("ERROR: --compact cannot be used with --hex\n");
+    return 1;
+  }
+
+  // a new archive has nothing to reclaim, only an existing or an updated one is compacted
+  if (compact && arg.size() == 1)
+  {
+    if (!Fs8FileSystem::compactFs8(arg[0]))
+      return 1;
+    printf("File successfully compacted\n");
+    return 0;
+  }
+
   if (arg.size() != 2)
   {
     usage();
     return 1;
   }
 
+  if (compact && !update)
+  {
+    printf("ERROR: --compact with a directory requires --update\n");
+    return 1;
+  }
+
   const char * initialDir = arg[0];
   const char * outFileName = arg[1];
 
@@ -112,10 +156,18 @@ int main(int argc, char ** argv)
   }
 
 
-  if (!Fs8FileSystem::createFs8FromFiles(initialDir, fileNames, outFileName, compression_level, hex_output, &ignoreList))
+  if (update)
+  {
+    if (!Fs8FileSystem::updateFs8FromFiles(initialDir, fileNames, outFileName, options, &ignoreList))
+      return 1;
+  }
+  else if (!Fs8FileSystem::createFs8FromFiles(initialDir, fileNames, outFileName, options, &ignoreList))
+    return 1;
+
+  if (compact && !Fs8FileSystem::compactFs8(outFileName))
     return 1;
 
-  printf("Files successfully packed with compression level %d\n", compression_level);
+  printf("Files successfully %s with compression level %d\n", update ? "updated" : "packed", options.compressionLevel);
 
   return 0;
 }